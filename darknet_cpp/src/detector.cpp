@@ -6,7 +6,10 @@
 #include "detector.hpp"
 #include "predictor_impl.hpp"
 #include "logging.hpp"
+#include "thread_pool.h"          /* darknet worker pool */
 #include <fstream>
+#include <cmath>
+#include <cfloat>
 
 using namespace Darknet;
 
@@ -14,22 +17,62 @@ class Detector::impl : public Predictor::impl
 {
 public:
     impl();
+    ~impl();
     bool setup(std::string net_cfg_file,
                 std::string weight_cfg_file,
                 float nms,
                 float thresh,
-                float hier_thresh);
-    bool post_process(size_t width, size_t height);
-    bool get_detections(Detection* detections, size_t size);
-    std::vector<Detection> get_detections();
-    size_t get_num_detections();
+                float hier_thresh,
+                int threads,
+                std::string tuning_cache,
+                NmsMethod nms_method);
+    bool set_max_candidates(size_t per_image, size_t per_class);
+    bool post_process(size_t width, size_t height, int batch_idx);
+    bool post_process(const std::vector<ImageSize>& sizes);
+    bool get_detections(Detection* detections, size_t size, int batch_idx);
+    std::vector<Detection> get_detections(int batch_idx);
+    size_t get_num_detections(int batch_idx);
 
 private:
+    /* post processing state and result of one image of the batch, reused by every post_process */
+    struct BatchImage
+    {
+        std::vector<Detection> detections;
+        detection_buffer boxes;
+
+        /* fused post processing */
+        std::vector<box> box_list;
+        std::vector<nms_candidate> candidates;
+        std::vector<float> scratch;
+        int     width;
+        int     height;
+        int     new_width;
+        int     new_height;
+        int     relative;
+    };
+
+    struct BatchArgs
+    {
+        impl* self;
+        const std::vector<ImageSize>* sizes;
+    };
+
+    static void post_process_images(void* args, int begin, int end);
+    bool valid_batch_idx(int batch_idx);
+    void post_process_image(int batch_idx, size_t width, size_t height);
+    bool fused();
+    void fused_post_process(BatchImage& image, int batch_idx);
+    void decode_yolo(BatchImage& image, const layer& l, const float* output, float cut, int& ties);
+    void decode_region(BatchImage& image, const layer& l, const float* output);
+    void add_box(BatchImage& image, box b);
+    void cap_classes(BatchImage& image);
+
     int     m_classes;
     float   m_nms;
+    NmsMethod m_nms_method;
     float   m_threshold;
     float   m_hier_threshold;
-    std::vector<Detection> m_detections;
+    std::vector<BatchImage> m_images;
 };
 
 /*
@@ -39,55 +82,352 @@ private:
 Detector::impl::impl() :
         m_classes(0),
         m_nms(0),
+        m_nms_method(NmsMethod::PAIRWISE),
         m_threshold(0),
         m_hier_threshold(0),
-        m_detections(0) {}
+        m_images(0) {}
+
+Detector::impl::~impl()
+{
+    for (BatchImage& image : m_images)
+        free_detection_buffer(&image.boxes);
+}
 
 bool Detector::impl::setup(std::string net_cfg_file,
                 std::string weight_cfg_file,
                 float nms,
                 float thresh,
-                float hier_thresh)
+                float hier_thresh,
+                int threads,
+                std::string tuning_cache,
+                NmsMethod nms_method)
 {
     m_nms = nms;
+    m_nms_method = nms_method;
     m_threshold = thresh;
     m_hier_threshold = hier_thresh;
 
-    if (!Predictor::impl::setup(net_cfg_file, weight_cfg_file))
+    if (!Predictor::impl::setup(net_cfg_file, weight_cfg_file, threads, tuning_cache))
         return false;
 
+    // only cells above the threshold get their boxes and classes decoded
+    set_network_lazy_decode(m_net, 1);
+
     layer l = m_net->layers[m_net->n-1];
     m_classes = l.classes;
     DPRINTF("Setup: layers = %d, %d, %d, classes = %d\n", l.w, l.h, l.n, m_classes);
 
+    for (BatchImage& image : m_images)
+        free_detection_buffer(&image.boxes);
+    m_images.clear();
+    m_images.resize(m_net->batch, BatchImage());
+
     return true;
 }
 
-bool Detector::impl::post_process(size_t width, size_t height)
+bool Detector::impl::set_max_candidates(size_t per_image, size_t per_class)
 {
-    int i;
-    int nboxes;
-    detection* dets;
-    int relative = 0;
-
     if (!m_bSetup) {
         EPRINTF("Not setup!\n");
         return false;
     }
 
+    set_network_max_candidates(m_net, per_image, per_class);
+    return true;
+}
+
+/*
+ *  Fused post processing, used unless do_nms is selected or the network has detection
+ *  layers or hierarchical (softmax tree) region layers.
+ *  The yolo and region outputs are decoded straight into boxes and (box, class)
+ *  candidates above the threshold, the candidate caps and class wise nms work on
+ *  those, and every box emits its most probable surviving class. Same detections as
+ *  get_network_boxes followed by do_nms_sweep, without the per box probability arrays.
+ */
+bool Detector::impl::fused()
+{
+    int i;
+
+    if (m_nms_method == NmsMethod::PAIRWISE)
+        return false;
+
+    for (i = 0; i < m_net->n; ++i) {
+        const layer& l = m_net->layers[i];
+        if (l.type == DETECTION)
+            return false;
+        if (l.type == REGION && l.softmax_tree)
+            return false;
+    }
+    return true;
+}
+
+static inline float logistic(float x)
+{
+    return 1.f/(1.f + expf(-x));
+}
+
+/* letterbox correction as correct_yolo_boxes */
+void Detector::impl::add_box(BatchImage& image, box b)
+{
+    int netw = m_net->w;
+    int neth = m_net->h;
+
+    b.x = (b.x - (netw - image.new_width)/2./netw) / ((float)image.new_width/netw);
+    b.y = (b.y - (neth - image.new_height)/2./neth) / ((float)image.new_height/neth);
+    b.w *= (float)netw/image.new_width;
+    b.h *= (float)neth/image.new_height;
+    if (!image.relative) {
+        b.x *= image.width;
+        b.w *= image.width;
+        b.y *= image.height;
+        b.h *= image.height;
+    }
+    image.box_list.push_back(b);
+}
+
+/* cells with objectness above cut, plus the first ties equal to it, see network_box_cut */
+void Detector::impl::decode_yolo(BatchImage& image, const layer& l, const float* output, float cut, int& ties)
+{
+    int i, n, j;
+    int stride = l.w*l.h;
+    bool lazy = l.lazy_decode;
+
+    for (i = 0; i < stride; ++i) {
+        for (n = 0; n < l.n; ++n) {
+            const float* p = output + n*stride*(4 + l.classes + 1) + i;
+            float objectness = p[4*stride];
+            if (objectness <= m_threshold || objectness < cut)
+                continue;
+            if (objectness == cut) {
+                if (ties <= 0)
+                    continue;
+                --ties;
+            }
+
+            float x = lazy ? logistic(p[0]) : p[0];
+            float y = lazy ? logistic(p[stride]) : p[stride];
+            box b;
+            b.x = (i % l.w + x) / l.w;
+            b.y = (i / l.w + y) / l.h;
+            b.w = exp((double)p[2*stride]) * l.biases[2*l.mask[n]] / m_net->w;
+            b.h = exp((double)p[3*stride]) * l.biases[2*l.mask[n] + 1] / m_net->h;
+
+            // lazy outputs hold raw class values, see get_yolo_detection_lazy
+            float logit = -FLT_MAX;
+            if (lazy) {
+                float r = m_threshold/objectness;
+                logit = (r > 0) ? logf(r/(1 - r)) - 1e-3 : -FLT_MAX;
+            }
+            size_t first = image.candidates.size();
+            int index = image.box_list.size();
+            for (j = 0; j < l.classes; ++j) {
+                float v = p[(5 + j)*stride];
+                float prob = lazy ? ((v > logit) ? objectness*logistic(v) : 0) : objectness*v;
+                if (prob > m_threshold)
+                    image.candidates.push_back({prob, index, j});
+            }
+            if (image.candidates.size() > first)
+                add_box(image, b);
+        }
+    }
+}
+
+/* as get_region_detections without a softmax tree, which orders boxes by anchor first */
+void Detector::impl::decode_region(BatchImage& image, const layer& l, const float* output)
+{
+    int i, n, j;
+    int stride = l.w*l.h;
+
+    for (n = 0; n < l.n; ++n) {
+        for (i = 0; i < stride; ++i) {
+            const float* p = output + n*stride*(l.coords + l.classes + 1) + i;
+            float scale = l.background ? 1 : p[l.coords*stride];
+            if (!(scale > m_threshold))
+                continue;
+
+            box b;
+            b.x = (i % l.w + p[0]) / l.w;
+            b.y = (i / l.w + p[stride]) / l.h;
+            b.w = exp((double)p[2*stride]) * l.biases[2*n] / l.w;
+            b.h = exp((double)p[3*stride]) * l.biases[2*n + 1] / l.h;
+
+            size_t first = image.candidates.size();
+            int index = image.box_list.size();
+            for (j = 0; j < l.classes; ++j) {
+                float prob = scale*p[(l.coords + 1 + j)*stride];
+                if (prob > m_threshold)
+                    image.candidates.push_back({prob, index, j});
+            }
+            if (image.candidates.size() > first)
+                add_box(image, b);
+        }
+    }
+}
+
+/* keep each class in at most max_class_candidates boxes, as cap_class_boxes */
+void Detector::impl::cap_classes(BatchImage& image)
+{
+    int k = m_net->max_class_candidates;
+    int j, above, ties;
+    size_t i;
+
+    if (k <= 0)
+        return;
+
+    // candidate indices grouped per class, each group in candidate order
+    std::vector<int> start(m_classes + 1, 0);
+    for (const nms_candidate& c : image.candidates)
+        ++start[c.class_id + 1];
+    for (j = 0; j < m_classes; ++j)
+        start[j + 1] += start[j];
+    std::vector<int> fill(start.begin(), start.end() - 1);
+    std::vector<int> order(image.candidates.size());
+    for (i = 0; i < image.candidates.size(); ++i)
+        order[fill[image.candidates[i].class_id]++] = i;
+
+    for (j = 0; j < m_classes; ++j) {
+        if (start[j + 1] - start[j] <= k)
+            continue;
+        image.scratch.clear();
+        for (int q = start[j]; q < start[j + 1]; ++q)
+            image.scratch.push_back(image.candidates[order[q]].prob);
+        float cut = nth_largest(&image.scratch[0], image.scratch.size(), k - 1);
+        above = 0;
+        for (float prob : image.scratch)
+            above += prob > cut;
+        ties = k - above;
+        for (int q = start[j]; q < start[j + 1]; ++q) {
+            nms_candidate& c = image.candidates[order[q]];
+            if (c.prob > cut)
+                continue;
+            if (c.prob == cut && ties > 0)
+                --ties;
+            else
+                c.prob = 0;
+        }
+    }
+}
+
+void Detector::impl::fused_post_process(BatchImage& image, int batch_idx)
+{
+    int i;
+    float cut = -FLT_MAX;
+    int ties = 0;
+    int netw = m_net->w;
+    int neth = m_net->h;
+
+    if (((float)netw/image.width) < ((float)neth/image.height)) {
+        image.new_width = netw;
+        image.new_height = (image.height * netw)/image.width;
+    } else {
+        image.new_height = neth;
+        image.new_width = (image.width * neth)/image.height;
+    }
+
+    // per image cap on the yolo cells, see network_box_cut
+    int k = m_net->max_candidates;
+    if (k > 0) {
+        image.scratch.clear();
+        for (i = 0; i < m_net->n; ++i) {
+            const layer& l = m_net->layers[i];
+            if (l.type != YOLO)
+                continue;
+            for (int n = 0; n < l.n; ++n) {
+                const float* obj = l.output + (size_t)batch_idx*l.outputs + (n*(4 + l.classes + 1) + 4)*l.w*l.h;
+                for (int j = 0; j < l.w*l.h; ++j)
+                    if (obj[j] > m_threshold)
+                        image.scratch.push_back(obj[j]);
+            }
+        }
+        if ((int)image.scratch.size() > k) {
+            cut = nth_largest(&image.scratch[0], image.scratch.size(), k - 1);
+            int above = 0;
+            for (float o : image.scratch)
+                above += o > cut;
+            ties = k - above;
+        }
+    }
+
+    image.box_list.clear();
+    image.candidates.clear();
+    for (i = 0; i < m_net->n; ++i) {
+        const layer& l = m_net->layers[i];
+        const float* output = l.output + (size_t)batch_idx*l.outputs;
+        if (l.type == YOLO)
+            decode_yolo(image, l, output, cut, ties);
+        if (l.type == REGION)
+            decode_region(image, l, output);
+    }
+
+    cap_classes(image);
+
+    if (m_nms > 0 && !image.candidates.empty())
+        do_nms_candidates(&image.box_list[0], image.box_list.size(), &image.candidates[0], image.candidates.size(), m_classes, m_nms);
+
+    // candidates come per box in class order: keep the first most probable
+    image.detections.clear();
+    size_t c = 0;
+    while (c < image.candidates.size()) {
+        int index = image.candidates[c].box;
+        const nms_candidate* best = nullptr;
+        for (; c < image.candidates.size() && image.candidates[c].box == index; ++c) {
+            if (image.candidates[c].prob > (best ? best->prob : 0))
+                best = &image.candidates[c];
+        }
+        if (best && best->prob > m_threshold) {
+            const box& b = image.box_list[index];
+            Detection detection;
+            detection.x = b.x;
+            detection.y = b.y;
+            detection.width = b.w;
+            detection.height = b.h;
+            detection.probability = best->prob;
+            detection.label_index = best->class_id;
+            image.detections.push_back(detection);
+        }
+    }
+}
+
+/* post process image batch_idx of the batch, of the given original size */
+void Detector::impl::post_process_image(int batch_idx, size_t width, size_t height)
+{
+    int i;
+    int nboxes;
+    detection* dets;
+    BatchImage& image = m_images[batch_idx];
+
+    image.relative = 0;
     if (width == 0 || height == 0) {
         width = m_net->w;
         height = m_net->h;
-        relative = 1;
+        image.relative = 1;
+    }
+    image.width = width;
+    image.height = height;
+
+    if (fused()) {
+        fused_post_process(image, batch_idx);
+        return;
     }
 
-    dets = get_network_boxes(m_net, width, height, m_threshold, m_hier_threshold, 0, relative, &nboxes);
+    dets = get_network_boxes_batch(m_net, batch_idx, width, height, m_threshold, m_hier_threshold, 0, image.relative, &image.boxes, &nboxes);
 
     // nms sets objectness and class probs to zero of suppressed boxes
-    if (m_nms > 0)
-        do_nms(dets, nboxes, m_classes, m_nms);
+    if (m_nms > 0) {
+        switch (m_nms_method) {
+        case NmsMethod::SORT:
+            do_nms_sort(dets, nboxes, m_classes, m_nms);
+            break;
+        case NmsMethod::SWEEP:
+            do_nms_sweep(dets, nboxes, m_classes, m_nms);
+            break;
+        default:
+            do_nms(dets, nboxes, m_classes, m_nms);
+            break;
+        }
+    }
 
-    m_detections.clear();
+    image.detections.clear();
 
     for (i = 0; i < nboxes; ++i) {
         float prob;
@@ -105,52 +445,102 @@ bool Detector::impl::post_process(size_t width, size_t height)
             detection.height = dets[i].bbox.h;
             detection.probability = prob;
             detection.label_index = class_index;
-            m_detections.push_back(detection);
+            image.detections.push_back(detection);
         }
     }
+}
 
-    free_detections(dets, nboxes);
+/* parallel_for task: every image only touches its own state and output slots */
+void Detector::impl::post_process_images(void* args, int begin, int end)
+{
+    BatchArgs* batch = static_cast<BatchArgs*>(args);
+    int i;
 
-    return true;
+    for (i = begin; i < end; ++i) {
+        const ImageSize& size = (*batch->sizes)[i];
+        batch->self->post_process_image(i, size.width, size.height);
+    }
 }
 
-bool Detector::impl::get_detections(Detection* detections, size_t size)
+bool Detector::impl::valid_batch_idx(int batch_idx)
 {
     if (!m_bSetup) {
         EPRINTF("Not setup!\n");
         return false;
     }
 
-    if (size < m_detections.size()) {
-        EPRINTF("Buffer size (%lu) too small to fit number of detections (%lu)\n", size, m_detections.size());
+    if (batch_idx < 0 || batch_idx >= (int)m_images.size()) {
+        EPRINTF("Batch index %d out of range, batch size is %lu\n", batch_idx, m_images.size());
         return false;
     }
 
-    // return a copy
-    memcpy(detections, &m_detections[0], m_detections.size() * sizeof(Detection));
+    return true;
+}
 
+bool Detector::impl::post_process(size_t width, size_t height, int batch_idx)
+{
+    if (!valid_batch_idx(batch_idx))
+        return false;
+
+    post_process_image(batch_idx, width, height);
     return true;
 }
 
-std::vector<Detection> Detector::impl::get_detections()
+bool Detector::impl::post_process(const std::vector<ImageSize>& sizes)
 {
+    size_t i;
+
     if (!m_bSetup) {
         EPRINTF("Not setup!\n");
-        return std::vector<Detection>();
+        return false;
+    }
+
+    if (sizes.size() > m_images.size()) {
+        EPRINTF("Number of images (%lu) must not exceed the batch size (%lu)\n", sizes.size(), m_images.size());
+        return false;
     }
 
+    // images of a partly filled batch have no detections
+    for (i = sizes.size(); i < m_images.size(); ++i)
+        m_images[i].detections.clear();
+
+    BatchArgs args = {this, &sizes};
+    parallel_for(sizes.size(), 1, post_process_images, &args);
+    return true;
+}
+
+bool Detector::impl::get_detections(Detection* detections, size_t size, int batch_idx)
+{
+    if (!valid_batch_idx(batch_idx))
+        return false;
+
+    const std::vector<Detection>& result = m_images[batch_idx].detections;
+    if (size < result.size()) {
+        EPRINTF("Buffer size (%lu) too small to fit number of detections (%lu)\n", size, result.size());
+        return false;
+    }
+
+    // return a copy
+    memcpy(detections, result.data(), result.size() * sizeof(Detection));
+
+    return true;
+}
+
+std::vector<Detection> Detector::impl::get_detections(int batch_idx)
+{
+    if (!valid_batch_idx(batch_idx))
+        return std::vector<Detection>();
+
     // return a copy (implicit vector copy)
-    return m_detections;
+    return m_images[batch_idx].detections;
 }
 
-size_t Detector::impl::get_num_detections()
+size_t Detector::impl::get_num_detections(int batch_idx)
 {
-    if (!m_bSetup) {
-        EPRINTF("Not setup!\n");
+    if (!valid_batch_idx(batch_idx))
         return 0;
-    }
 
-    return m_detections.size();
+    return m_images[batch_idx].detections.size();
 }
 
 /*
@@ -167,29 +557,41 @@ bool Detector::setup(std::string net_cfg_file,
                 std::string weight_cfg_file,
                 float nms,
                 float thresh,
-                float hier_thresh)
+                float hier_thresh,
+                int threads,
+                std::string tuning_cache,
+                NmsMethod nms_method)
 {
     return pimpl->setup(net_cfg_file, weight_cfg_file, nms,
-                            thresh, hier_thresh);
+                            thresh, hier_thresh, threads, tuning_cache, nms_method);
+}
+
+bool Detector::set_max_candidates(size_t per_image, size_t per_class)
+{
+    return pimpl->set_max_candidates(per_image, per_class);
 }
 
 bool Detector::post_process(size_t width, size_t height, int batch_idx)
 {
-    (void)batch_idx;
-    return pimpl->post_process(width, height);
+    return pimpl->post_process(width, height, batch_idx);
+}
+
+bool Detector::post_process(const std::vector<ImageSize>& sizes)
+{
+    return pimpl->post_process(sizes);
 }
 
-std::vector<Detection> Detector::get_detections()
+std::vector<Detection> Detector::get_detections(int batch_idx)
 {
-    return pimpl->get_detections();
+    return pimpl->get_detections(batch_idx);
 }
 
-bool Detector::get_detections(Detection* detections, size_t size)
+bool Detector::get_detections(Detection* detections, size_t size, int batch_idx)
 {
-    return pimpl->get_detections(detections, size);
+    return pimpl->get_detections(detections, size, batch_idx);
 }
 
-size_t Detector::get_num_detections()
+size_t Detector::get_num_detections(int batch_idx)
 {
-    return pimpl->get_num_detections();
+    return pimpl->get_num_detections(batch_idx);
 }
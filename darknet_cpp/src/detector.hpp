@@ -12,12 +12,30 @@
 namespace Darknet
 {
 
+/* Non maxima suppression method used by Detector::post_process */
+enum class NmsMethod
+{
+    PAIRWISE,   /* do_nms: every pair of boxes over all classes (original behaviour) */
+    SORT,       /* do_nms_sort: greedy per class in descending probability */
+    SWEEP       /* do_nms_sweep: same result as SORT, sorted once and spatially indexed */
+};
+
+/* Original size of an image in the batch, see Detector::post_process */
+struct ImageSize
+{
+    size_t width;
+    size_t height;
+};
+
 class Detector : public Predictor
 {
 public:
     Detector();
 
-    /* NOTE: detector currently only supports batch size 1 */
+    /*
+     *  NOTE: the batch size comes from the network configuration file. Every image of
+     *  a batch is a separate input, see PreprocessCv::run for building the input blob
+     */
 
     /*
      *  Setup network for detection, call this one i.s.o. the setup method in the Predictor class
@@ -27,6 +45,12 @@ public:
      *  thresh:             detection threshold. Detection probabilities lower than this threshold
      *                      will not be considered detections (number between 0 and 1)
      *  hier_thres:         Hierarchical threshold ??? (number between 0 and 1)
+     *  threads:            number of CPU threads used for inference, see Predictor::setup
+     *  tuning_cache:       convolution tuning cache, see Predictor::setup
+     *  nms_method:         non maxima suppression algorithm, SWEEP is the fastest for
+     *                      crowded outputs. With SORT or SWEEP, yolo and region outputs
+     *                      are decoded, suppressed and turned into detections in one
+     *                      fused stage, without darknet's intermediate detection structs
      *
      *  returns true on success
      */
@@ -34,15 +58,27 @@ public:
                 std::string weight_cfg_file,
                 float nms,
                 float thresh,
-                float hier_thresh);
+                float hier_thresh,
+                int threads = -1,
+                std::string tuning_cache = "",
+                NmsMethod nms_method = NmsMethod::PAIRWISE);
 
     /*
-     *  Post process detections for one forward pass (call after predict)
+     *  Bound the post processing work on crowded frames (call after setup)
+     *  per_image:      keep at most this many boxes, those with the highest objectness
+     *  per_class:      keep each class in at most this many boxes, those most probable for it
+     *  Zero means no limit. Only applies to yolo networks.
+     *  returns true on success
+     */
+    bool set_max_candidates(size_t per_image, size_t per_class = 0);
+
+    /*
+     *  Post process detections of one image of the last forward pass (call after predict)
      *  This method calculates bounding boxes, probabilties and applies NMS
      *
      *  width:          width dimension of the detections (normally the original image width)
      *  height:         height dimension of the detections (normally the original image height)
-     *  batch_idx:      Currently ignored
+     *  batch_idx:      index of the image in the batch
      *  returns true on success
      *
      *  The detection values x, y, width, height have dimensions according to the given width/height
@@ -50,11 +86,23 @@ public:
      */
     bool post_process(size_t width = 0, size_t height = 0, int batch_idx = 0);
 
+    /*
+     *  Post process detections of every image of the last forward pass (call after predict)
+     *  The images are processed in parallel on the CPU threads given to setup
+     *
+     *  sizes:          original size of each image, in batch order. A partly filled batch
+     *                  passes fewer sizes than the batch size, the remaining images get no
+     *                  detections. A zero width or height gives relative coordinates
+     *  returns true on success
+     */
+    bool post_process(const std::vector<ImageSize>& sizes);
+
     /*
      *  Get the post processed detections (call after post_process)
+     *  batch_idx:      index of the image in the batch
      *  returns a list of detections
      */
-    std::vector<Detection> get_detections();
+    std::vector<Detection> get_detections(int batch_idx = 0);
 
     /*
      *  Get the post processed detections (call after post_process)
@@ -62,14 +110,15 @@ public:
      *                  The buffer must be large enough. Call get_num_detections() to know the
      *                  minimum required buffer size.
      *  size:           Size of the buffer (in number of Detection structs)
+     *  batch_idx:      index of the image in the batch
      *  returns true on success
      */
-    bool get_detections(Detection* detections, size_t size);
+    bool get_detections(Detection* detections, size_t size, int batch_idx = 0);
 
     /*
-     *  Return the number of detections in the last output
+     *  Return the number of detections of an image in the last output
      */
-    size_t get_num_detections();
+    size_t get_num_detections(int batch_idx = 0);
 
 private:
 
@@ -36,4 +36,13 @@ extern "C" {
     EXPORT_DLL bool detector_post_process(Detector* self, size_t width, size_t height, int batch_idx) { return self->post_process(width, height, batch_idx); }
     EXPORT_DLL bool detector_get_detections(Detector* self, Detection* detections, size_t size) { return self->get_detections(detections, size); }
     EXPORT_DLL size_t detector_get_num_detections(Detector* self) { return self->get_num_detections(); }
+    EXPORT_DLL bool detector_post_process_batch(Detector* self, const size_t* widths, const size_t* heights, size_t n)
+    {
+        std::vector<ImageSize> sizes(n);
+        for (size_t i = 0; i < n; ++i)
+            sizes[i] = {widths[i], heights[i]};
+        return self->post_process(sizes);
+    }
+    EXPORT_DLL bool detector_get_batch_detections(Detector* self, Detection* detections, size_t size, int batch_idx) { return self->get_detections(detections, size, batch_idx); }
+    EXPORT_DLL size_t detector_get_batch_num_detections(Detector* self, int batch_idx) { return self->get_num_detections(batch_idx); }
 }
@@ -17,9 +17,20 @@ void Predictor::set_impl(std::shared_ptr<Predictor::impl> impl)
     pimpl = impl;
 }
 
-bool Predictor::setup(std::string net_cfg_file, std::string weight_cfg_file)
+bool Predictor::setup(std::string net_cfg_file, std::string weight_cfg_file, int threads,
+                std::string tuning_cache)
 {
-    return pimpl->setup(net_cfg_file, weight_cfg_file);
+    return pimpl->setup(net_cfg_file, weight_cfg_file, threads, tuning_cache);
+}
+
+bool Predictor::enable_int8(std::string calibration_file)
+{
+    return pimpl->enable_int8(calibration_file);
+}
+
+bool Predictor::enable_nhwc()
+{
+    return pimpl->enable_nhwc();
 }
 
 void Predictor::teardown()
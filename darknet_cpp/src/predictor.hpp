@@ -22,10 +22,36 @@ public:
      *  General network setup
      *  net_cfg_file:       network configuration file that describes the network architecture
      *  weight_cfg_file:    weights file that contains the trained network weights
+     *  threads:            number of CPU threads used for inference, 0 uses all online cores,
+     *                      below 0 leaves the thread count as it is (a single thread at first).
+     *                      NOTE: the CPU thread pool is shared by all predictors in the process,
+     *                      an explicit count resizes it for every instance
+     *  tuning_cache:       if not empty, benchmark the convolution algorithms of each layer
+     *                      and keep the fastest. Results are stored in this file (keyed by
+     *                      CPU model, threads and layer shape) and reused on later setups
      *
      *  returns true on success
      */
-    virtual bool setup(std::string net_cfg_file, std::string weight_cfg_file);
+    virtual bool setup(std::string net_cfg_file, std::string weight_cfg_file, int threads = -1,
+                std::string tuning_cache = "");
+
+    /*
+     *  Run the convolutional layers listed in a calibration file with int8 arithmetic.
+     *  Call after setup. The file is made with 'darknet detector calibrate'.
+     *  Not available once the NHWC layout is enabled.
+     *  calibration_file:   per-layer input and weight scales
+     *
+     *  returns true on success
+     */
+    bool enable_int8(std::string calibration_file);
+
+    /*
+     *  Run the CPU forward pass on interleaved (NHWC) activations. Call after setup;
+     *  input and output stay planar. Not available once int8 layers are enabled.
+     *
+     *  returns true if every layer supports the layout, the network is unchanged otherwise
+     */
+    bool enable_nhwc();
 
     /*
      *  Cleanup the network
@@ -18,7 +18,8 @@ Predictor::impl::~impl()
     teardown();
 }
 
-bool Predictor::impl::setup(std::string net_cfg_file, std::string weight_cfg_file)
+bool Predictor::impl::setup(std::string net_cfg_file, std::string weight_cfg_file, int threads,
+                std::string tuning_cache)
 {
     if (m_bSetup) {
         EPRINTF("Network already setup!\n");
@@ -35,18 +36,68 @@ bool Predictor::impl::setup(std::string net_cfg_file, std::string weight_cfg_fil
         return false;
     }
 
-    m_net = load_network(net_cfg_file.c_str(), weight_cfg_file.c_str(), 0);
+    // the pool is shared, only an explicit count resizes it
+    if (threads >= 0)
+        set_cpu_threads(threads);
+
+    m_net = load_network_inference(net_cfg_file.c_str(), weight_cfg_file.c_str());
     if (!m_net) {
         EPRINTF("Failed to load network %s, %s\n", net_cfg_file.c_str(), weight_cfg_file.c_str());
         return false;
     }
 
-    DPRINTF("Setup: net->n = %d\n", m_net->n);
+    // the predictor never trains, so batchnorm can be merged into the weights
+    // and residual adds into the convolutions feeding them
+    fold_batchnorm_network(m_net);
+    fuse_shortcut_network(m_net);
+    if (!tuning_cache.empty())
+        tune_network(m_net, tuning_cache.c_str());
+    // route layers become views of the layers they concatenate, and
+    // intermediate activations share one arena
+    set_network_route_views(m_net);
+    size_t arena = set_network_arena(m_net);
+    (void) arena;
+
+    DPRINTF("Setup: activation arena = %zu bytes\n", arena);
+    DPRINTF("Setup: net->n = %d, cpu threads = %d\n", m_net->n, get_cpu_threads());
     DPRINTF("Setup: Done\n");
     m_bSetup = true;
     return true;
 }
 
+bool Predictor::impl::enable_int8(std::string calibration_file)
+{
+    if (!m_bSetup) {
+        EPRINTF("Not Setup!\n");
+        return false;
+    }
+
+    if (!file_exists(calibration_file)) {
+        EPRINTF("Calibration file %s not found\n", calibration_file.c_str());
+        return false;
+    }
+
+    if (!load_quantization(m_net, calibration_file.c_str())) {
+        EPRINTF("Int8 layers are not available with the NHWC layout\n");
+        return false;
+    }
+    return true;
+}
+
+bool Predictor::impl::enable_nhwc()
+{
+    if (!m_bSetup) {
+        EPRINTF("Not Setup!\n");
+        return false;
+    }
+
+    if (!set_network_nhwc(m_net)) {
+        EPRINTF("Network has layers without an NHWC implementation\n");
+        return false;
+    }
+    return true;
+}
+
 void Predictor::impl::teardown()
 {
     m_bSetup = false;
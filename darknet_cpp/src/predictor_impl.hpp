@@ -17,7 +17,10 @@ class Predictor::impl
 public:
     impl();
     ~impl();
-    bool setup(std::string net_cfg_file, std::string weight_cfg_file);
+    bool setup(std::string net_cfg_file, std::string weight_cfg_file, int threads,
+                std::string tuning_cache);
+    bool enable_int8(std::string calibration_file);
+    bool enable_nhwc();
     void teardown();
     bool predict(const float* data, size_t size);
     int get_width();
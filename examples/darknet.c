@@ -1,4 +1,5 @@
 #include "darknet.h"
+#include "pruning.h"
 
 #include <time.h>
 #include <stdlib.h>
@@ -365,6 +366,25 @@ void denormalize_net(char *cfgfile, char *weightfile, char *outfile)
     save_weights(net, outfile);
 }
 
+void fold_batchnorm_net(char *cfgfile, char *weightfile, char *outcfg, char *outweights)
+{
+    gpu_index = -1;
+    network *net = load_network(cfgfile, weightfile, 0);
+    fold_batchnorm_network(net);
+    save_network_cfg(net, cfgfile, outcfg);
+    save_weights(net, outweights);
+}
+
+void compact_net(char *cfgfile, char *weightfile, char *outcfg, char *outweights)
+{
+    gpu_index = -1;
+    network *net = load_network(cfgfile, weightfile, 0);
+    int removed = compact_network(net);
+    fprintf(stderr, "Removed %d filters\n", removed);
+    save_network_cfg(net, cfgfile, outcfg);
+    save_weights(net, outweights);
+}
+
 void mkimg(char *cfgfile, char *weightfile, int h, int w, int num, char *prefix)
 {
     network *net = load_network(cfgfile, weightfile, 0);
@@ -410,6 +430,7 @@ int main(int argc, char **argv)
     if(find_arg(argc, argv, "-nogpu")) {
         gpu_index = -1;
     }
+    set_cpu_threads(find_int_arg(argc, argv, "-threads", 1));
 
 #ifndef GPU
     gpu_index = -1;
@@ -469,6 +490,10 @@ int main(int argc, char **argv)
         reset_normalize_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "denormalize")){
         denormalize_net(argv[2], argv[3], argv[4]);
+    } else if (0 == strcmp(argv[1], "fold")){
+        fold_batchnorm_net(argv[2], argv[3], argv[4], argv[5]);
+    } else if (0 == strcmp(argv[1], "compact")){
+        compact_net(argv[2], argv[3], argv[4], argv[5]);
     } else if (0 == strcmp(argv[1], "statistics")){
         statistics_net(argv[2], argv[3]);
     } else if (0 == strcmp(argv[1], "normalize")){
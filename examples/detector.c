@@ -1,6 +1,23 @@
 #include "darknet.h"
 #include "pruning.h"
 
+// quantization file given with -int8, applied to the test and valid networks
+static const char *int8_calibration = 0;
+// -tune: convolution tuning cache file, see tune_network
+static const char *tune_cache = 0;
+// -nhwc: run the test and valid networks on interleaved activations
+static int nhwc_layout = 0;
+
+static void prepare_detector_network(network *net)
+{
+    if(int8_calibration) load_quantization(net, int8_calibration);
+    if(tune_cache) tune_network(net, tune_cache);
+    if(nhwc_layout && !set_network_nhwc(net)) fprintf(stderr, "NHWC layout not supported by this network, keeping NCHW\n");
+    set_network_route_views(net);
+    set_network_arena(net);
+    set_network_lazy_decode(net, 1);
+}
+
 static int coco_ids[] = {1,2,3,4,5,6,7,8,9,10,11,13,14,15,16,17,18,19,20,21,22,23,24,25,27,28,31,32,33,34,35,36,37,38,39,40,41,42,43,44,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,67,70,72,73,74,75,76,77,78,79,80,81,82,84,85,86,87,88,89,90};
 
 /* workaround for opencv 3.x when compiling in debug mode */
@@ -320,7 +337,7 @@ void validate_detector_flip(const char *datacfg, const char *cfgfile, const char
     int *map = 0;
     if (mapf) map = read_map(mapf);
 
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 2);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
@@ -412,7 +429,7 @@ void validate_detector_flip(const char *datacfg, const char *cfgfile, const char
             int h = val[t].h;
             int num = 0;
             detection *dets = get_network_boxes(net, w, h, thresh, .5, map, 0, &num);
-            if (nms) do_nms_sort(dets, num, classes, nms);
+            if (nms) do_nms_sweep(dets, num, classes, nms);
             if (coco){
                 print_cocos(fp, path, dets, num, classes, w, h);
             } else if (imagenet){
@@ -463,8 +480,9 @@ void validate_detector(const char *datacfg, const char *cfgfile, const char *wei
     int *map = 0;
     if (mapf) map = read_map(mapf);
 
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
+    prepare_detector_network(net);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
 
@@ -555,6 +573,8 @@ void validate_detector(const char *datacfg, const char *cfgfile, const char *wei
         args.resized = &buf_resized[t];
         thr[t] = load_data_in_thread(args);
     }
+    // one set of detections reused for every image
+    detection_buffer boxes = {0};
     double start = what_time_is_it_now();
     for(i = nthreads; i < m+nthreads; i += nthreads){
         fprintf(stderr, "%d\n", i);
@@ -577,8 +597,8 @@ void validate_detector(const char *datacfg, const char *cfgfile, const char *wei
             int w = val[t].w;
             int h = val[t].h;
             int nboxes = 0;
-            detection *dets = get_network_boxes(net, w, h, thresh, .5, map, 0, &nboxes);
-            if (nms) do_nms_sort(dets, nboxes, classes, nms);
+            detection *dets = get_network_boxes_buffer(net, w, h, thresh, .5, map, 0, &boxes, &nboxes);
+            if (nms) do_nms_sweep(dets, nboxes, classes, nms);
             if (coco){
                 print_cocos(fp, path, dets, nboxes, classes, w, h);
             } else if (imagenet){
@@ -588,12 +608,12 @@ void validate_detector(const char *datacfg, const char *cfgfile, const char *wei
             } else {
                 print_voc_detections(fps, id, dets, nboxes, classes, w, h);
             }
-            free_detections(dets, nboxes);
             free(id);
             free_image(val[t]);
             free_image(val_resized[t]);
         }
     }
+    free_detection_buffer(&boxes);
     for(j = 0; j < classes; ++j){
         if(fps) fclose(fps[j]);
     }
@@ -605,12 +625,46 @@ void validate_detector(const char *datacfg, const char *cfgfile, const char *wei
     fprintf(stderr, "Total Detection Time: %f Seconds\n", what_time_is_it_now() - start);
 }
 
+void calibrate_detector(const char *datacfg, const char *cfgfile, const char *weightfile, char *outfile)
+{
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.list");
+    int max = option_find_int(options, "calibration_images", 500);
+
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+    fold_batchnorm_network(net);
+
+    list *plist = get_paths(valid_images);
+    char **paths = (char **)list_to_array(plist);
+    int m = plist->size < max ? plist->size : max;
+    float *ranges = calloc(net->n, sizeof(float));
+    int i;
+
+    for(i = 0; i < m; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        network_predict(net, sized.data);
+        quantization_observe(net, sized.data, ranges);
+        free_image(im);
+        free_image(sized);
+        if(i % 50 == 0) fprintf(stderr, "%d/%d\n", i, m);
+    }
+    if(!outfile) outfile = "int8.calib";
+    save_quantization(net, ranges, outfile);
+    fprintf(stderr, "Calibrated on %d images, saved to %s\n", m, outfile);
+    free(ranges);
+    free(paths);
+    free_list(plist);
+    free_network(net);
+}
+
 void validate_detector_recall(const char *datacfg, const char *cfgfile, const char *weightfile)
 {
     list *options = read_data_cfg(datacfg);
     char *valid_images = option_find_str(options, "valid", "data/voc.2007.test");
 
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
@@ -685,7 +739,7 @@ void validate_detector_PRcurve(const char *datacfg, const char *cfgfile, const c
     list *options = read_data_cfg(datacfg);
     char *valid_images = option_find_str(options, "valid", "data/voc.2007.test");
 
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
@@ -803,8 +857,9 @@ void test_detector(const char *datacfg, const char *cfgfile, const char *weightf
     char **names = get_labels(name_list);
 
     image **alphabet = load_alphabet();
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
+    prepare_detector_network(net);
     srand(2222222);
     double time;
     char buff[256];
@@ -837,7 +892,7 @@ void test_detector(const char *datacfg, const char *cfgfile, const char *weightf
         detection *dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes);
         //printf("%d\n", nboxes);
         //if (nms) do_nms_obj(boxes, probs, l.w*l.h*l.n, l.classes, nms);
-        if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        if (nms) do_nms_sweep(dets, nboxes, l.classes, nms);
         draw_detections(im, dets, nboxes, thresh, names, alphabet, l.classes);
         free_detections(dets, nboxes);
         if(outfile){
@@ -871,6 +926,9 @@ void run_detector(int argc, char **argv)
     }
     char *gpu_list = find_char_arg(argc, argv, "-gpus", 0);
     char *outfile = find_char_arg(argc, argv, "-out", 0);
+    int8_calibration = find_char_arg(argc, argv, "-int8", 0);
+    tune_cache = find_char_arg(argc, argv, "-tune", 0);
+    nhwc_layout = find_arg(argc, argv, "-nhwc");
     int *gpus = 0;
     int gpu = 0;
     int ngpus = 0;
@@ -908,6 +966,7 @@ void run_detector(int argc, char **argv)
     else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
     else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
+    else if(0==strcmp(argv[2], "calibrate")) calibrate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(datacfg, cfg, weights);
     else if(0==strcmp(argv[2], "PRcurve")) validate_detector_PRcurve(datacfg, cfg, weights);
     else if(0==strcmp(argv[2], "demo")) {
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #ifdef GPU
@@ -94,6 +95,11 @@ typedef enum{
     SSE, MASKED, L1, SEG, SMOOTH,WGAN
 } COST_TYPE;
 
+// CPU convolution strategies, picked per layer by tune_network
+typedef enum{
+    CONV_DEFAULT, CONV_GEMM, CONV_WINOGRAD, CONV_SPARSE, CONV_DEPTHWISE
+} CONV_ALGORITHM;
+
 typedef struct{
     int batch;
     float learning_rate;
@@ -124,6 +130,7 @@ struct layer{
     void (*update_gpu)    (struct layer, update_args);
     int batch_normalize;
     int shortcut;
+    int fused;
     int batch;
     int forced;
     int flipped;
@@ -199,6 +206,7 @@ struct layer{
     int absolute;
 
     int onlyforward;
+    int lazy_decode;
     int stopbackward;
     int dontload;
     int dontsave;
@@ -228,6 +236,18 @@ struct layer{
     float * concat_delta;
 
     float * binary_weights;
+    float * winograd_weights;
+    float * packed_weights;
+    uint64_t * bit_weights;
+    float * bit_scales;
+    struct sparse_matrix * sparse_weights;
+    float * nhwc_weights;
+    CONV_ALGORITHM algorithm;
+
+    float quant_input_scale;
+    float * quant_weight_scales;
+    int * quant_offsets;
+    signed char * quant_weights;
 
     float * biases;
     float * bias_updates;
@@ -240,6 +260,7 @@ struct layer{
 
     float * delta;
     float * output;
+    int output_view;    // output lives in a route's buffer or the arena, not owned
     float * loss;
     float * squared;
     float * norms;
@@ -491,6 +512,19 @@ typedef struct network{
     float *cost;
     float clip;
 
+    // CPU inference on interleaved (HWC) activations, see set_network_nhwc
+    int nhwc;
+    float *nhwc_buffer;
+    int route_views;
+    // training buffers were never kept, see load_network_inference
+    int inference;
+    // shared activation memory for inference, see set_network_arena
+    int arena;
+    float *arena_buffer;
+    // caps on the boxes from get_network_boxes, see set_network_max_candidates
+    int max_candidates;
+    int max_class_candidates;
+
 #ifdef GPU
     float *input_gpu;
     float *truth_gpu;
@@ -530,6 +564,28 @@ typedef struct detection{
     int sort_class;
 } detection;
 
+/*
+ * Detections reused across frames: one allocation holding the structs,
+ * then all class probabilities as rows of classes floats, then the masks.
+ * It only grows. Zero-initialize, release with free_detection_buffer.
+ */
+typedef struct detection_buffer{
+    detection *dets;
+    int n;
+    int size;
+    int classes;
+    int masks;
+    float *prob;
+    float *mask;
+} detection_buffer;
+
+/* one class of one box, see do_nms_candidates */
+typedef struct nms_candidate{
+    float prob;
+    int box;
+    int class_id;
+} nms_candidate;
+
 typedef struct matrix{
     int rows, cols;
     float **vals;
@@ -590,6 +646,7 @@ typedef struct{
 
 
 network *load_network(const char *cfg, const char *weights, int clear);
+network *load_network_inference(const char *cfg, const char *weights);
 load_args get_base_args(network *net);
 
 void free_data(data d);
@@ -618,6 +675,9 @@ void forward_network(network *net);
 void backward_network(network *net);
 void update_network(network *net);
 
+void set_cpu_threads(int n);
+int get_cpu_threads();
+
 
 float dot_cpu(int N, float *X, int INCX, float *Y, int INCY);
 void axpy_cpu(int N, float ALPHA, float *X, int INCX, float *Y, int INCY);
@@ -673,6 +733,17 @@ image make_random_image(int w, int h, int c);
 
 void denormalize_connected_layer(layer l);
 void denormalize_convolutional_layer(layer l);
+void fold_batchnorm_network(network *net);
+void fuse_shortcut_network(network *net);
+int set_network_nhwc(network *net);
+int set_network_route_views(network *net);
+size_t set_network_arena(network *net);
+void set_network_lazy_decode(network *net, int lazy);
+void set_network_max_candidates(network *net, int per_image, int per_class);
+void tune_network(network *net, const char *cache_file);
+void quantization_observe(network *net, float *input, float *ranges);
+void save_quantization(network *net, float *ranges, const char *filename);
+int load_quantization(network *net, const char *filename);
 void statistics_connected_layer(layer l);
 void rescale_weights(layer l, float scale, float trans);
 void rgbgr_weights(layer l);
@@ -687,6 +758,7 @@ int option_find_int_quiet(list *l, char *key, int def);
 
 network *parse_network_cfg(const char *filename);
 void save_weights(network *net, const char *filename);
+void save_network_cfg(network *net, const char *cfgfile, const char *filename);
 void load_weights(network *net, const char *filename);
 void save_weights_upto(network *net, const char *filename, int cutoff);
 void load_weights_upto(network *net, const char *filename, int start, int cutoff);
@@ -751,6 +823,10 @@ float *network_predict_image(network *net, image im);
 void network_detect(network *net, image im, float thresh, float hier_thresh, float nms, detection *dets);
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
 void free_detections(detection *dets, int n);
+detection *make_network_boxes_buffer(network *net, float thresh, detection_buffer *buf, int *num);
+detection *get_network_boxes_buffer(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection_buffer *buf, int *num);
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, detection_buffer *buf, int *num);
+void free_detection_buffer(detection_buffer *buf);
 
 void reset_network_state(network *net, int b);
 
@@ -758,6 +834,8 @@ char **get_labels(char *filename);
 void do_nms_obj(detection *dets, int total, int classes, float thresh);
 void do_nms_sort(detection *dets, int total, int classes, float thresh);
 void do_nms(detection *dets, int total, int classes, float thresh);
+void do_nms_sweep(detection *dets, int total, int classes, float thresh);
+void do_nms_candidates(box *boxes, int nboxes, nms_candidate *candidates, int n, int classes, float thresh);
 
 matrix make_matrix(int rows, int cols);
 
@@ -787,6 +865,7 @@ void strip(char *s);
 float sec(clock_t clocks);
 void **list_to_array(list *l);
 void top_k(float *a, int n, int k, int *index);
+float nth_largest(float *a, int n, int k);
 int *read_map(char *filename);
 void error(const char *s);
 int max_index(float *a, int n);
@@ -1,4 +1,5 @@
 #include "activations.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <stdio.h>
@@ -97,14 +98,119 @@ float activate(float x, ACTIVATION a)
     return 0;
 }
 
-void activate_array(float *x, const int n, const ACTIVATION a)
+/*
+ * exp(x) = 2^n * exp(r) with n = round(x/ln2), |r| <= ln2/2, and exp(r)
+ * from the Cephes expf polynomial: relative error below 2e-7 over the
+ * clamped range, i.e. within a couple of ulp of expf. Written without
+ * calls or branches so the loops below vectorize.
+ */
+static inline __attribute__((always_inline)) float fast_exp(float x)
+{
+    x = (x < -87.f) ? -87.f : x;
+    x = (x > 88.f) ? 88.f : x;
+    // round through an int conversion, which -ffast-math can't fold away
+    int k = (int)(x*1.44269504f + ((x > 0) ? .5f : -.5f));
+    float n = k;
+    float r = x - n*.693359375f + n*2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    p = p*r*r + r + 1.f;
+    int e = (k + 127) << 23;
+    float scale;
+    memcpy(&scale, &e, sizeof(scale));
+    return p*scale;
+}
+
+/* the switch runs once per call, each case is a plain loop over x */
+static inline __attribute__((always_inline)) void activate_body(float *x, int n, ACTIVATION a)
 {
     int i;
-    for(i = 0; i < n; ++i){
-        x[i] = activate(x[i], a);
+    switch(a){
+        case LINEAR:
+            break;
+        case LEAKY:
+            for(i = 0; i < n; ++i) x[i] = (x[i] > 0) ? x[i] : .1f*x[i];
+            break;
+        case RELU:
+            for(i = 0; i < n; ++i) x[i] = (x[i] > 0) ? x[i] : 0;
+            break;
+        case LOGISTIC:
+            for(i = 0; i < n; ++i) x[i] = 1.f/(1.f + fast_exp(-x[i]));
+            break;
+        case TANH:
+            for(i = 0; i < n; ++i) x[i] = 2.f/(1.f + fast_exp(-2.f*x[i])) - 1.f;
+            break;
+        default:
+            for(i = 0; i < n; ++i) x[i] = activate(x[i], a);
     }
 }
 
+typedef void (*activate_fn)(float *x, int n, ACTIVATION a);
+
+static void activate_generic(float *x, int n, ACTIVATION a)
+{
+    activate_body(x, n, a);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ACTIVATE_X86
+__attribute__((target("avx2,fma")))
+static void activate_avx2(float *x, int n, ACTIVATION a)
+{
+    activate_body(x, n, a);
+}
+#endif
+
+static activate_fn activate_selected;
+static pthread_once_t activate_once = PTHREAD_ONCE_INIT;
+
+static void activate_select_init()
+{
+#ifdef ACTIVATE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        activate_selected = activate_avx2;
+        return;
+    }
+#endif
+    activate_selected = activate_generic;
+}
+
+static activate_fn activate_select()
+{
+    pthread_once(&activate_once, activate_select_init);
+    return activate_selected;
+}
+
+/* activate_array on the calling thread, for callers already inside a task */
+void activate_array_serial(float *x, const int n, const ACTIVATION a)
+{
+    if(a == LINEAR) return;
+    activate_select()(x, n, a);
+}
+
+typedef struct{
+    float *x;
+    ACTIVATION a;
+} activate_args;
+
+static void activate_range(void *ptr, int begin, int end)
+{
+    activate_args *args = ptr;
+    activate_array_serial(args->x + begin, end - begin, args->a);
+}
+
+void activate_array(float *x, const int n, const ACTIVATION a)
+{
+    activate_args args = {x, a};
+    if(a == LINEAR) return;
+    parallel_for(n, 16384, activate_range, &args);
+}
+
 float gradient(float x, ACTIVATION a)
 {
     switch(a){
@@ -0,0 +1,200 @@
+#include "darknet.h"
+#include "convolutional_layer.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+// timed runs per candidate, after one warm-up run
+#define TUNE_REPS 3
+
+/*
+ * One line per tuned layer:
+ *   cpu threads c h w n groups size stride pad batch sparse algorithm
+ * where cpu is the processor's model name with blanks replaced by '_'.
+ */
+typedef struct{
+    char cpu[256];
+    int key[11];
+    CONV_ALGORITHM algorithm;
+} tune_entry;
+
+typedef struct{
+    tune_entry *entries;
+    int n;
+    int size;
+} tune_cache;
+
+static void cpu_model_name(char *name, size_t size)
+{
+    char line[512];
+    char *p;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    strncpy(name, "unknown", size);
+    if(fp){
+        while(fgets(line, sizeof(line), fp)){
+            if(strncmp(line, "model name", 10) || !(p = strchr(line, ':'))) continue;
+            ++p;
+            while(*p && isspace((unsigned char)*p)) ++p;
+            strncpy(name, p, size - 1);
+            name[size - 1] = 0;
+            break;
+        }
+        fclose(fp);
+    }
+    for(p = name; *p; ++p){
+        if(isspace((unsigned char)*p)) *p = '_';
+    }
+    while(p > name && p[-1] == '_') *--p = 0;
+}
+
+static void tune_key(layer l, int *key)
+{
+    key[0] = get_cpu_threads();
+    key[1] = l.c;
+    key[2] = l.h;
+    key[3] = l.w;
+    key[4] = l.n;
+    key[5] = l.groups;
+    key[6] = l.size;
+    key[7] = l.stride;
+    key[8] = l.pad;
+    key[9] = l.batch;
+    key[10] = convolutional_algorithm_available(l, CONV_SPARSE);
+}
+
+static void tune_cache_add(tune_cache *c, const char *cpu, const int *key, CONV_ALGORITHM a)
+{
+    if(c->n == c->size){
+        c->size = c->size ? 2*c->size : 64;
+        c->entries = realloc(c->entries, c->size*sizeof(tune_entry));
+        if(!c->entries) malloc_error();
+    }
+    strncpy(c->entries[c->n].cpu, cpu, sizeof(c->entries[c->n].cpu) - 1);
+    c->entries[c->n].cpu[sizeof(c->entries[c->n].cpu) - 1] = 0;
+    memcpy(c->entries[c->n].key, key, sizeof(c->entries[c->n].key));
+    c->entries[c->n].algorithm = a;
+    ++c->n;
+}
+
+static tune_entry *tune_cache_find(tune_cache *c, const char *cpu, const int *key)
+{
+    int i;
+    for(i = 0; i < c->n; ++i){
+        tune_entry *e = c->entries + i;
+        if(!strcmp(e->cpu, cpu) && !memcmp(e->key, key, sizeof(e->key))) return e;
+    }
+    return 0;
+}
+
+static void load_tune_cache(tune_cache *c, const char *filename)
+{
+    char cpu[256], algorithm[32];
+    int k[11];
+    FILE *fp = fopen(filename, "r");
+    if(!fp) return;
+    while(fscanf(fp, "%255s %d %d %d %d %d %d %d %d %d %d %d %31s",
+                cpu, k, k+1, k+2, k+3, k+4, k+5, k+6, k+7, k+8, k+9, k+10, algorithm) == 13){
+        tune_cache_add(c, cpu, k, get_convolutional_algorithm(algorithm));
+    }
+    fclose(fp);
+}
+
+static void save_tune_cache(tune_cache *c, const char *filename)
+{
+    int i, j;
+    FILE *fp = fopen(filename, "w");
+    if(!fp){
+        fprintf(stderr, "Couldn't write tuning cache %s\n", filename);
+        return;
+    }
+    for(i = 0; i < c->n; ++i){
+        tune_entry *e = c->entries + i;
+        fprintf(fp, "%s", e->cpu);
+        for(j = 0; j < 11; ++j) fprintf(fp, " %d", e->key[j]);
+        fprintf(fp, " %s\n", get_convolutional_algorithm_string(e->algorithm));
+    }
+    fclose(fp);
+}
+
+static double time_convolutional_algorithm(layer *l, network net, CONV_ALGORITHM a)
+{
+    int r;
+    double best = 0;
+    set_convolutional_algorithm(l, a);
+    for(r = 0; r <= TUNE_REPS; ++r){
+        double t = what_time_is_it_now();
+        forward_convolutional_layer(*l, net);
+        t = what_time_is_it_now() - t;
+        if(r == 1 || (r > 1 && t < best)) best = t;
+    }
+    return best;
+}
+
+/*
+ * Inference only: time every available algorithm of each convolutional
+ * layer on random input and keep the fastest. Results are looked up in,
+ * and new ones appended to, cache_file (if given), keyed by CPU model,
+ * thread count and layer geometry, so later loads skip the benchmark.
+ * Call after the weights are final (batchnorm folding, pruning, etc).
+ */
+void tune_network(network *net, const char *cache_file)
+{
+    int i, changed = 0;
+    size_t size = 0;
+    char cpu[256];
+    tune_cache cache = {0};
+#ifdef GPU
+    if(net->gpu_index >= 0) return;
+#endif
+    cpu_model_name(cpu, sizeof(cpu));
+    if(cache_file) load_tune_cache(&cache, cache_file);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL && (size_t)l.inputs*l.batch > size) size = (size_t)l.inputs*l.batch;
+    }
+    float *input = calloc(size ? size : 1, sizeof(float));
+    if(!input) malloc_error();
+    for(i = 0; i < size; ++i) input[i] = rand_uniform(-1, 1);
+
+    network tmp = *net;
+    tmp.train = 0;
+    tmp.nhwc = 0;
+    tmp.input = input;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        int key[11];
+        CONV_ALGORITHM a, best = CONV_GEMM;
+        double best_time = 0;
+        if(l->type != CONVOLUTIONAL || l->binary || l->xnor || l->quant_weights) continue;
+        tune_key(*l, key);
+        tune_entry *e = tune_cache_find(&cache, cpu, key);
+        if(e && convolutional_algorithm_available(*l, e->algorithm)){
+            best = e->algorithm;
+        } else {
+            tmp.index = i;
+            for(a = CONV_GEMM; a <= CONV_DEPTHWISE; ++a){
+                if(!convolutional_algorithm_available(*l, a)) continue;
+                double t = time_convolutional_algorithm(l, tmp, a);
+                if(a == CONV_GEMM || t < best_time){
+                    best = a;
+                    best_time = t;
+                }
+            }
+            fprintf(stderr, "tune %3d conv %4d %2d x%2d /%2d  %4d x%4d x%4d: %-9s %8.3f ms\n", i, l->n, l->size, l->size, l->stride,
+                    l->w, l->h, l->c, get_convolutional_algorithm_string(best), best_time*1000);
+            tune_cache_add(&cache, cpu, key, best);
+            changed = 1;
+        }
+        // packed filters are only read by gemm, forward packs them again if it comes back
+        if(best != CONV_GEMM){
+            free(l->packed_weights);
+            l->packed_weights = 0;
+        }
+        set_convolutional_algorithm(l, best);
+    }
+    if(cache_file && changed) save_tune_cache(&cache, cache_file);
+    free(cache.entries);
+    free(input);
+}
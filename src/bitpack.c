@@ -0,0 +1,270 @@
+#include "bitpack.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <math.h>
+
+/*
+ * Layouts, with cw = bitpack_words(c) words per pixel:
+ *   input:   zero padded image, [h + 2*pad][w + 2*pad][cw], channel bits
+ *   weights: blocks of BITPACK_MR filters, [size][size][cw][BITPACK_MR]
+ * so for each kernel row a column's window is one contiguous run of
+ * size*cw words in both, and im2col never has to be materialized.
+ */
+// filters interleaved word by word, sharing each load of the input window
+#define BITPACK_MR 8
+
+typedef void (*xnor_kernel_fn)(int cols, int ldc, int runs, int len, const uint64_t *a, const uint64_t *x, int ldx, int *mismatch);
+
+/*
+ * For each of cols windows, x + j*ldc:
+ *   mismatch[j][r] = popcount(a[r] ^ x) summed over runs of len words
+ */
+static inline __attribute__((always_inline)) void xnor_kernel_body(int cols, int ldc, int runs, int len, const uint64_t *a, const uint64_t *x, int ldx, int *mismatch)
+{
+    int i, j, w, r;
+    for(j = 0; j < cols; ++j){
+        const uint64_t *pa = a;
+        int *c = mismatch + j*BITPACK_MR;
+        memset(c, 0, BITPACK_MR*sizeof(int));
+        for(i = 0; i < runs; ++i){
+            for(w = 0; w < len; ++w){
+                uint64_t xw = x[j*ldc + i*ldx + w];
+                for(r = 0; r < BITPACK_MR; ++r){
+                    c[r] += __builtin_popcountll(pa[r] ^ xw);
+                }
+                pa += BITPACK_MR;
+            }
+        }
+    }
+}
+
+static void xnor_kernel_generic(int cols, int ldc, int runs, int len, const uint64_t *a, const uint64_t *x, int ldx, int *mismatch)
+{
+    xnor_kernel_body(cols, ldc, runs, len, a, x, ldx, mismatch);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITPACK_X86
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static void xnor_kernel_popcnt(int cols, int ldc, int runs, int len, const uint64_t *a, const uint64_t *x, int ldx, int *mismatch)
+{
+    xnor_kernel_body(cols, ldc, runs, len, a, x, ldx, mismatch);
+}
+
+/* two windows at a time so each load of 8 filter words is used twice */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void xnor_kernel_avx512(int cols, int ldc, int runs, int len, const uint64_t *a, const uint64_t *x, int ldx, int *mismatch)
+{
+    int i, j, w;
+    for(j = 0; j < cols; j += 2){
+        const uint64_t *x0 = x + j*ldc;
+        const uint64_t *x1 = (j + 1 < cols) ? x0 + ldc : x0;
+        const uint64_t *pa = a;
+        __m512i c0 = _mm512_setzero_si512();
+        __m512i c1 = _mm512_setzero_si512();
+        for(i = 0; i < runs; ++i){
+            for(w = 0; w < len; ++w){
+                __m512i av = _mm512_loadu_si512(pa);
+                c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(_mm512_xor_si512(av, _mm512_set1_epi64(x0[i*ldx + w]))));
+                c1 = _mm512_add_epi64(c1, _mm512_popcnt_epi64(_mm512_xor_si512(av, _mm512_set1_epi64(x1[i*ldx + w]))));
+                pa += BITPACK_MR;
+            }
+        }
+        _mm256_storeu_si256((__m256i *)(mismatch + j*BITPACK_MR), _mm512_cvtepi64_epi32(c0));
+        if(j + 1 < cols) _mm256_storeu_si256((__m256i *)(mismatch + (j + 1)*BITPACK_MR), _mm512_cvtepi64_epi32(c1));
+    }
+}
+#endif
+
+static xnor_kernel_fn xnor_kernel_selected;
+static pthread_once_t xnor_kernel_once = PTHREAD_ONCE_INIT;
+
+static void xnor_select_kernel_init()
+{
+#ifdef BITPACK_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vpopcntdq")){
+        xnor_kernel_selected = xnor_kernel_avx512;
+        return;
+    }
+    if(__builtin_cpu_supports("popcnt")){
+        xnor_kernel_selected = xnor_kernel_popcnt;
+        return;
+    }
+#endif
+    xnor_kernel_selected = xnor_kernel_generic;
+}
+
+static xnor_kernel_fn xnor_select_kernel()
+{
+    pthread_once(&xnor_kernel_once, xnor_select_kernel_init);
+    return xnor_kernel_selected;
+}
+
+int bitpack_supported(int groups)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return groups == 1;
+}
+
+size_t bitpack_words(int c)
+{
+    return (c + BITPACK_WORD - 1)/BITPACK_WORD;
+}
+
+size_t bitpack_weights_size(int n, int c, int size)
+{
+    return (size_t)(n + BITPACK_MR - 1)/BITPACK_MR*BITPACK_MR*size*size*bitpack_words(c);
+}
+
+/*
+ * Same binarization as binarize_weights: the sign of each weight, scaled by
+ * the mean magnitude of its filter.
+ */
+void bitpack_weights(float *weights, int n, int c, int size, uint64_t *bits, float *scales)
+{
+    size_t cw = bitpack_words(c);
+    int k = c*size*size;
+    int f, i;
+    memset(bits, 0, bitpack_weights_size(n, c, size)*sizeof(uint64_t));
+    for(f = 0; f < n; ++f){
+        float mean = 0;
+        uint64_t *block = bits + f/BITPACK_MR*BITPACK_MR*size*size*cw + f%BITPACK_MR;
+        for(i = 0; i < k; ++i){
+            float w = weights[f*k + i];
+            int ch = i/(size*size);
+            int tap = i%(size*size);
+            mean += fabs(w);
+            if(w > 0) block[(tap*cw + ch/BITPACK_WORD)*BITPACK_MR] |= (uint64_t)1 << (ch%BITPACK_WORD);
+        }
+        scales[f] = mean/k;
+    }
+}
+
+typedef struct{
+    const layer *l;
+    float *im;
+    uint64_t *bits;
+    int *tap_counts;
+    int cw, pw, ph;
+    const gemm_epilogue *ep;
+    float *out;
+} xnor_args;
+
+static void xnor_pack_rows(void *ptr, int begin, int end)
+{
+    xnor_args *a = ptr;
+    const layer *l = a->l;
+    int y, x, c;
+    for(y = begin; y < end; ++y){
+        uint64_t *row = a->bits + ((size_t)(y + l->pad)*a->pw + l->pad)*a->cw;
+        memset(row, 0, (size_t)l->w*a->cw*sizeof(uint64_t));
+        for(c = 0; c < l->c; ++c){
+            const float *src = a->im + ((size_t)c*l->h + y)*l->w;
+            uint64_t *dst = row + c/BITPACK_WORD;
+            int shift = c%BITPACK_WORD;
+            for(x = 0; x < l->w; ++x){
+                dst[x*a->cw] |= (uint64_t)(src[x] > 0) << shift;
+            }
+        }
+    }
+}
+
+/*
+ * Padding reads zero bits, which the kernel counts as mismatches against
+ * every set weight bit. Those taps must contribute nothing, so border
+ * columns take the weight popcount of their outside taps back out.
+ */
+static void xnor_count_taps(const layer *l, int cw, int *counts)
+{
+    int taps = l->size*l->size;
+    int f, t, i;
+    for(f = 0; f < l->n; ++f){
+        const uint64_t *block = l->bit_weights + (size_t)f/BITPACK_MR*BITPACK_MR*taps*cw + f%BITPACK_MR;
+        for(t = 0; t < taps; ++t){
+            int sum = 0;
+            for(i = 0; i < cw; ++i) sum += __builtin_popcountll(block[(t*cw + i)*BITPACK_MR]);
+            counts[f*taps + t] = sum;
+        }
+    }
+}
+
+static int xnor_padding_mismatch(const layer *l, const int *counts, int y0, int x0)
+{
+    int ky, kx, sum = 0;
+    for(ky = 0; ky < l->size; ++ky){
+        for(kx = 0; kx < l->size; ++kx){
+            int y = y0 + ky, x = x0 + kx;
+            if(y < 0 || y >= l->h || x < 0 || x >= l->w) sum += counts[ky*l->size + kx];
+        }
+    }
+    return sum;
+}
+
+static void xnor_output_rows(void *ptr, int begin, int end)
+{
+    xnor_args *a = ptr;
+    const layer *l = a->l;
+    xnor_kernel_fn kernel = xnor_select_kernel();
+    int lda = l->size*l->size*a->cw;
+    int len = l->size*a->cw;
+    int ldx = a->pw*a->cw;
+    int n = l->out_w*l->out_h;
+    int *mismatch = calloc((size_t)l->out_w*BITPACK_MR, sizeof(int));
+    int *taps = calloc(l->out_w, sizeof(int));
+    int oy, ox, i, r;
+    if(!mismatch || !taps) malloc_error();
+    for(oy = begin; oy < end; ++oy){
+        int y0 = oy*l->stride - l->pad;
+        int rows_in = l->size - (y0 < 0 ? -y0 : 0) - (y0 + l->size > l->h ? y0 + l->size - l->h : 0);
+        const uint64_t *x = a->bits + (size_t)oy*l->stride*ldx;
+        for(ox = 0; ox < l->out_w; ++ox){
+            int x0 = ox*l->stride - l->pad;
+            taps[ox] = rows_in*(l->size - (x0 < 0 ? -x0 : 0) - (x0 + l->size > l->w ? x0 + l->size - l->w : 0));
+        }
+        for(i = 0; i < l->n; i += BITPACK_MR){
+            int rows = (l->n - i < BITPACK_MR) ? l->n - i : BITPACK_MR;
+            const uint64_t *w = l->bit_weights + (size_t)i*lda;
+            kernel(l->out_w, l->stride*a->cw, l->size, len, w, x, ldx, mismatch);
+            for(r = 0; r < rows; ++r){
+                int f = i + r;
+                float *out = a->out + (size_t)f*n + oy*l->out_w;
+                for(ox = 0; ox < l->out_w; ++ox){
+                    int mis = mismatch[ox*BITPACK_MR + r];
+                    if(taps[ox] < l->size*l->size){
+                        mis -= xnor_padding_mismatch(l, a->tap_counts + f*l->size*l->size, y0, ox*l->stride - l->pad);
+                    }
+                    out[ox] = l->bit_scales[f]*(taps[ox]*l->c - 2*mis);
+                }
+                if(a->ep) gemm_epilogue_run(a->ep, f, oy*l->out_w, out, l->out_w);
+            }
+        }
+    }
+    free(mismatch);
+    free(taps);
+}
+
+/* one image of the batch: out = epilogue(xnor_conv(im)) */
+void xnor_convolve(layer l, float *im, const gemm_epilogue *ep, float *out)
+{
+    xnor_args a = {0};
+    a.l = &l;
+    a.im = im;
+    a.cw = bitpack_words(l.c);
+    a.pw = l.w + 2*l.pad;
+    a.ph = l.h + 2*l.pad;
+    a.bits = calloc((size_t)a.pw*a.ph*a.cw, sizeof(uint64_t));
+    a.tap_counts = calloc(l.n*l.size*l.size, sizeof(int));
+    if(!a.bits || !a.tap_counts) malloc_error();
+    xnor_count_taps(&l, a.cw, a.tap_counts);
+    a.ep = ep;
+    a.out = out;
+    parallel_for(l.h, 1, xnor_pack_rows, &a);
+    parallel_for(l.out_h, 1, xnor_output_rows, &a);
+    free(a.bits);
+    free(a.tap_counts);
+}
@@ -0,0 +1,20 @@
+#ifndef BITPACK_H
+#define BITPACK_H
+#include "darknet.h"
+#include "gemm.h"
+
+/*
+ * Bit-packed xnor convolution.
+ * Weights and inputs are reduced to their signs, 64 channels per word, and
+ * each dot product becomes valid - 2*popcount(w ^ x). Taps that fall in the
+ * zero padding are taken back out so results match the float xnor path.
+ */
+#define BITPACK_WORD 64
+
+int bitpack_supported(int groups);
+size_t bitpack_words(int c);
+size_t bitpack_weights_size(int n, int c, int size);
+void bitpack_weights(float *weights, int n, int c, int size, uint64_t *bits, float *scales);
+void xnor_convolve(layer l, float *im, const gemm_epilogue *ep, float *out);
+
+#endif
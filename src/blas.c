@@ -1,4 +1,5 @@
 #include "blas.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <assert.h>
@@ -32,19 +33,25 @@ void reorg_cpu(float *x, int w, int h, int c, int batch, int stride, int forward
 void flatten(float *x, int size, int layers, int batch, int forward)
 {
     float *swap = calloc(size*layers*batch, sizeof(float));
+    flatten_cpu(x, size, layers, batch, forward, swap);
+    memcpy(x, swap, size*layers*batch*sizeof(float));
+    free(swap);
+}
+
+/* forward: planar [layers][size] to interleaved [size][layers]; else back */
+void flatten_cpu(float *x, int size, int layers, int batch, int forward, float *out)
+{
     int i,c,b;
     for(b = 0; b < batch; ++b){
         for(c = 0; c < layers; ++c){
             for(i = 0; i < size; ++i){
                 int i1 = b*layers*size + c*size + i;
                 int i2 = b*layers*size + i*layers + c;
-                if (forward) swap[i2] = x[i1];
-                else swap[i1] = x[i2];
+                if (forward) out[i2] = x[i1];
+                else out[i1] = x[i2];
             }
         }
     }
-    memcpy(x, swap, size*layers*batch*sizeof(float));
-    free(swap);
 }
 
 void weighted_sum_cpu(float *a, float *b, float *s, int n, float *c)
@@ -144,19 +151,33 @@ void l2normalize_cpu(float *x, float *dx, int batch, int filters, int spatial)
 }
 
 
-void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+typedef struct{
+    float *x;
+    float *mean;
+    float *variance;
+    int filters;
+    int spatial;
+} normalize_args;
+
+static void normalize_planes(void *ptr, int begin, int end)
 {
-    int b, f, i;
-    for(b = 0; b < batch; ++b){
-        for(f = 0; f < filters; ++f){
-            for(i = 0; i < spatial; ++i){
-                int index = b*filters*spatial + f*spatial + i;
-                x[index] = (x[index] - mean[f])/(sqrt(variance[f]) + .000001f);
-            }
+    normalize_args *args = ptr;
+    int p, i;
+    for(p = begin; p < end; ++p){
+        int f = p % args->filters;
+        float *x = args->x + p*args->spatial;
+        for(i = 0; i < args->spatial; ++i){
+            x[i] = (x[i] - args->mean[f])/(sqrt(args->variance[f]) + .000001f);
         }
     }
 }
 
+void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+{
+    normalize_args args = {x, mean, variance, filters, spatial};
+    parallel_for(batch*filters, 1 + 16384/spatial, normalize_planes, &args);
+}
+
 void const_cpu(int N, float ALPHA, float *X, int INCX)
 {
     int i;
@@ -331,21 +352,40 @@ void softmax_cpu(float *input, int n, int batch, int batch_offset, int groups, i
     }
 }
 
-void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
+typedef struct{
+    float *in;
+    int w, h;
+    int stride;
+    int forward;
+    float scale;
+    float *out;
+} upsample_args;
+
+static void upsample_planes(void *ptr, int begin, int end)
 {
-    int i, j, k, b;
-    for(b = 0; b < batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h*stride; ++j){
-                for(i = 0; i < w*stride; ++i){
-                    int in_index = b*w*h*c + k*w*h + (j/stride)*w + i/stride;
-                    int out_index = b*w*h*c*stride*stride + k*w*h*stride*stride + j*w*stride + i;
-                    if(forward) out[out_index] = scale*in[in_index];
-                    else in[in_index] += scale*out[out_index];
-                }
+    upsample_args *args = ptr;
+    int w = args->w;
+    int h = args->h;
+    int stride = args->stride;
+    int i, j, p;
+    for(p = begin; p < end; ++p){
+        float *in = args->in + p*w*h;
+        float *out = args->out + p*w*h*stride*stride;
+        for(j = 0; j < h*stride; ++j){
+            for(i = 0; i < w*stride; ++i){
+                int in_index = (j/stride)*w + i/stride;
+                int out_index = j*w*stride + i;
+                if(args->forward) out[out_index] = args->scale*in[in_index];
+                else in[in_index] += args->scale*out[out_index];
             }
         }
     }
 }
 
+void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
+{
+    upsample_args args = {in, w, h, stride, forward, scale, out};
+    parallel_for(batch*c, 1 + 16384/(w*h*stride*stride), upsample_planes, &args);
+}
+
 
@@ -37,3 +37,27 @@ void col2im_cpu(float* data_col,
     }
 }
 
+
+// Accumulate columns [col0, col0 + ncols) of an im2col matrix stored with ld ncols.
+void col2im_cols_cpu(float* data_col,
+         int channels,  int height,  int width,
+         int ksize,  int stride, int pad,
+         int col0, int ncols, float* data_im)
+{
+    int c,i;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+
+    int channels_col = channels * ksize * ksize;
+    for (c = 0; c < channels_col; ++c) {
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        for (i = 0; i < ncols; ++i) {
+            int im_row = h_offset + (col0 + i) / width_col * stride;
+            int im_col = w_offset + (col0 + i) % width_col * stride;
+            double val = data_col[c*ncols + i];
+            col2im_add_pixel(data_im, height, width, channels,
+                    im_row, im_col, c_im, pad, val);
+        }
+    }
+}
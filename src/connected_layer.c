@@ -5,12 +5,21 @@
 #include "cuda.h"
 #include "blas.h"
 #include "gemm.h"
+#include "sparse.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+static int use_packed_weights()
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return 1;
+}
+
 layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam)
 {
     int i;
@@ -149,6 +158,35 @@ void update_connected_layer(layer l, update_args a)
     scal_cpu(l.inputs*l.outputs, momentum, l.weight_updates, 1);
 }
 
+/*
+ * Inference only: make the GEMM-packed and sparse weights once they are
+ * loaded, kept up to date by transform_connected_weights from then on.
+ */
+void make_connected_inference_weights(layer *l)
+{
+    if(!use_packed_weights()) return;
+    if(!l->packed_weights){
+        l->packed_weights = calloc(gemm_packed_b_size(l->outputs, l->inputs), sizeof(float));
+        if(!l->packed_weights) malloc_error();
+    }
+    if(!l->sparse_weights) l->sparse_weights = make_sparse_matrix(l->outputs, l->inputs);
+    transform_connected_weights(*l);
+}
+
+/*
+ * Refresh the GEMM-packed and sparse copies of l.weights used by the CPU
+ * forward pass.
+ */
+void transform_connected_weights(layer l)
+{
+    if(l.packed_weights){
+        gemm_prepack_b(1, l.outputs, l.inputs, l.weights, l.inputs, l.packed_weights);
+    }
+    if(l.sparse_weights){
+        sparse_matrix_update(l.sparse_weights, l.weights);
+    }
+}
+
 void forward_connected_layer(layer l, network net)
 {
     fill_cpu(l.outputs*l.batch, 0, l.output, 1);
@@ -158,7 +196,12 @@ void forward_connected_layer(layer l, network net)
     float *a = net.input;
     float *b = l.weights;
     float *c = l.output;
-    gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
+    if(l.sparse_weights && l.sparse_weights->active && !net.train){
+        sparse_gemv_cpu(l.sparse_weights, a, m, c);
+    } else {
+        // updates don't refresh the packed weights, training packs its own
+        gemm_packed_cpu(0,1,m,n,k,a,k,0,b,k,net.train ? 0 : l.packed_weights,c,n,0);
+    }
     if(l.batch_normalize){
         forward_batchnorm_layer(l, net);
     } else {
@@ -210,9 +253,30 @@ void denormalize_connected_layer(layer l)
         l.rolling_mean[i] = 0;
         l.rolling_variance[i] = 1;
     }
+    transform_connected_weights(l);
 }
 
 
+void fold_batchnorm_connected_layer(layer *l)
+{
+    int i, j;
+    if(!l->batch_normalize) return;
+    for(i = 0; i < l->outputs; ++i){
+        float scale = l->scales[i]/(sqrt(l->rolling_variance[i]) + .000001f);
+        for(j = 0; j < l->inputs; ++j){
+            l->weights[i*l->inputs + j] *= scale;
+        }
+        l->biases[i] -= l->rolling_mean[i]*scale;
+    }
+    l->batch_normalize = 0;
+    transform_connected_weights(*l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_connected_layer(*l);
+    }
+#endif
+}
+
 void statistics_connected_layer(layer l)
 {
     if(l.batch_normalize){
@@ -10,6 +10,9 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
 void forward_connected_layer(layer l, network net);
 void backward_connected_layer(layer l, network net);
 void update_connected_layer(layer l, update_args a);
+void transform_connected_weights(layer l);
+void fold_batchnorm_connected_layer(layer *l);
+void make_connected_inference_weights(layer *l);
 
 #ifdef GPU
 void forward_connected_layer_gpu(layer l, network net);
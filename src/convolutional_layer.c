@@ -5,8 +5,14 @@
 #include "col2im.h"
 #include "blas.h"
 #include "gemm.h"
+#include "winograd.h"
+#include "quantize.h"
+#include "bitpack.h"
+#include "depthwise.h"
+#include "sparse.h"
 #include <stdio.h>
 #include <time.h>
+#include <string.h>
 
 #ifdef AI2
 #include "xnor_layer.h"
@@ -83,6 +89,39 @@ image get_convolutional_delta(convolutional_layer l)
     return float_to_image(l.out_w,l.out_h,l.out_c,l.delta);
 }
 
+// output columns per im2col block in the CPU backward pass
+#define CONV_COL_BLOCK 256
+
+static int conv_col_block(layer l)
+{
+    int n = l.out_h*l.out_w;
+    return (n < CONV_COL_BLOCK) ? n : CONV_COL_BLOCK;
+}
+
+static int use_winograd(layer l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return winograd_supported(l.size, l.stride, l.groups, l.c) && !l.binary && !l.xnor;
+}
+
+static int use_packed_weights(layer l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return !l.winograd_weights && !l.binary && !l.xnor && !depthwise_supported(l.c, l.groups);
+}
+
+static int use_sparse_weights(layer l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return l.groups == 1 && !l.binary && !l.xnor;
+}
+
 static size_t get_workspace_size(layer l){
 #ifdef CUDNN
     if(gpu_index >= 0){
@@ -115,7 +154,15 @@ static size_t get_workspace_size(layer l){
         return most;
     }
 #endif
-    return (size_t)l.out_h*l.out_w*l.size*l.size*l.c/l.groups*sizeof(float);
+#ifdef GPU
+    if(gpu_index >= 0) return (size_t)l.out_h*l.out_w*l.size*l.size*l.c/l.groups*sizeof(float);
+#endif
+    size_t im2col_size = (size_t)conv_col_block(l)*l.size*l.size*l.c/l.groups*sizeof(float);
+    if(l.winograd_weights){
+        size_t winograd_size = winograd_workspace_size(l.n, l.c, l.out_h, l.out_w);
+        if(winograd_size > im2col_size) return winograd_size;
+    }
+    return im2col_size;
 }
 
 #ifdef GPU
@@ -340,6 +387,132 @@ void denormalize_convolutional_layer(convolutional_layer l)
         l.rolling_mean[i] = 0;
         l.rolling_variance[i] = 1;
     }
+    transform_convolutional_weights(l);
+}
+
+/*
+ * Inference only: fold the rolling batchnorm statistics into the filters and
+ * biases (with the same epsilon as normalize_cpu) and drop the batchnorm pass.
+ */
+void fold_batchnorm_convolutional_layer(convolutional_layer *l)
+{
+    int i, j;
+    int size = l->c/l->groups*l->size*l->size;
+    if(!l->batch_normalize) return;
+    for(i = 0; i < l->n; ++i){
+        float scale = l->scales[i]/(sqrt(l->rolling_variance[i]) + .000001f);
+        for(j = 0; j < size; ++j){
+            l->weights[i*size + j] *= scale;
+        }
+        l->biases[i] -= l->rolling_mean[i]*scale;
+    }
+    l->batch_normalize = 0;
+    transform_convolutional_weights(*l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_convolutional_layer(*l);
+    }
+#endif
+}
+
+/*
+ * Inference only: fold batchnorm and keep the filters packed for the
+ * interleaved (NHWC) forward pass, where each output pixel is one row of
+ * a GEMM against the [n][size][size][c] filter matrix.
+ */
+void nhwc_convolutional_layer(convolutional_layer *l)
+{
+    fold_batchnorm_convolutional_layer(l);
+    if(!l->nhwc_weights){
+        l->nhwc_weights = calloc(gemm_packed_b_size(l->n, l->size*l->size*l->c), sizeof(float));
+        if(!l->nhwc_weights) malloc_error();
+    }
+    transform_convolutional_weights(*l);
+}
+
+/*
+ * Packed filters for the inference gemm, made when an inference network is
+ * loaded or gemm is selected. Training packs them on the fly instead.
+ */
+static void pack_convolutional_weights(convolutional_layer *l)
+{
+    int j;
+    int m = l->n/l->groups;
+    int k = l->size*l->size*l->c/l->groups;
+    l->packed_weights = calloc(l->groups*gemm_packed_a_size(m, k), sizeof(float));
+    if(!l->packed_weights) malloc_error();
+    for(j = 0; j < l->groups; ++j){
+        gemm_prepack_a(0, m, k, l->weights + j*l->nweights/l->groups, k, l->packed_weights + j*gemm_packed_a_size(m, k));
+    }
+}
+
+/*
+ * Inference only: make the winograd, sign bit and sparse forms of the
+ * filters, and the packed ones for a layer that runs on gemm, once its
+ * weights are loaded. Kept up to date by transform_convolutional_weights
+ * from then on. Winograd may need a larger workspace.
+ */
+void make_convolutional_inference_weights(convolutional_layer *l)
+{
+    if(!l->winograd_weights && use_winograd(*l)){
+        l->winograd_weights = calloc(winograd_weights_size(l->n, l->c), sizeof(float));
+        if(!l->winograd_weights) malloc_error();
+        winograd_transform_weights(l->weights, l->n, l->c, l->winograd_weights);
+        l->workspace_size = get_workspace_size(*l);
+    }
+    if(!l->bit_weights && l->xnor && bitpack_supported(l->groups)){
+        l->bit_weights = calloc(bitpack_weights_size(l->n, l->c, l->size), sizeof(uint64_t));
+        l->bit_scales = calloc(l->n, sizeof(float));
+        if(!l->bit_weights || !l->bit_scales) malloc_error();
+        bitpack_weights(l->weights, l->n, l->c, l->size, l->bit_weights, l->bit_scales);
+    }
+    if(!l->sparse_weights && use_sparse_weights(*l)){
+        l->sparse_weights = make_sparse_matrix(l->n, l->size*l->size*l->c);
+        sparse_matrix_update(l->sparse_weights, l->weights);
+    }
+    if(!l->packed_weights && use_packed_weights(*l) && convolutional_algorithm(*l) == CONV_GEMM){
+        pack_convolutional_weights(l);
+    }
+}
+
+/*
+ * Refresh the precomputed forms of l.weights used by the CPU forward pass.
+ * Call whenever the weights of an inference network are changed.
+ */
+void transform_convolutional_weights(convolutional_layer l)
+{
+    int j;
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    if(l.winograd_weights){
+        winograd_transform_weights(l.weights, l.n, l.c, l.winograd_weights);
+    }
+    if(l.packed_weights){
+        for(j = 0; j < l.groups; ++j){
+            gemm_prepack_a(0, m, k, l.weights + j*l.nweights/l.groups, k, l.packed_weights + j*gemm_packed_a_size(m, k));
+        }
+    }
+    if(l.bit_weights){
+        bitpack_weights(l.weights, l.n, l.c, l.size, l.bit_weights, l.bit_scales);
+    }
+    if(l.sparse_weights){
+        sparse_matrix_update(l.sparse_weights, l.weights);
+    }
+    if(l.nhwc_weights){
+        int f, c, t;
+        int taps = l.size*l.size;
+        float *w = calloc(l.nweights, sizeof(float));
+        if(!w) malloc_error();
+        for(f = 0; f < l.n; ++f){
+            for(c = 0; c < l.c; ++c){
+                for(t = 0; t < taps; ++t){
+                    w[(f*taps + t)*l.c + c] = l.weights[(f*l.c + c)*taps + t];
+                }
+            }
+        }
+        gemm_prepack_b(1, l.n, k, w, k, l.nhwc_weights);
+        free(w);
+    }
 }
 
 /*
@@ -442,13 +615,134 @@ void backward_bias(float *bias_updates, float *delta, int batch, int n, int size
     }
 }
 
-void forward_convolutional_layer(convolutional_layer l, network net)
+int convolutional_algorithm_available(convolutional_layer l, CONV_ALGORITHM a)
+{
+    switch(a){
+        case CONV_GEMM:
+            return !l.binary && !l.xnor;
+        case CONV_WINOGRAD:
+            return l.winograd_weights != 0;
+        case CONV_SPARSE:
+            return l.sparse_weights && l.sparse_weights->active;
+        case CONV_DEPTHWISE:
+            return depthwise_supported(l.c, l.groups);
+        default:
+            return 0;
+    }
+}
+
+/* the tuned algorithm, else the first available of sparse, winograd, depthwise, gemm */
+CONV_ALGORITHM convolutional_algorithm(convolutional_layer l)
+{
+    if(l.algorithm != CONV_DEFAULT && convolutional_algorithm_available(l, l.algorithm)) return l.algorithm;
+    if(convolutional_algorithm_available(l, CONV_SPARSE)) return CONV_SPARSE;
+    if(convolutional_algorithm_available(l, CONV_WINOGRAD)) return CONV_WINOGRAD;
+    if(convolutional_algorithm_available(l, CONV_DEPTHWISE)) return CONV_DEPTHWISE;
+    return CONV_GEMM;
+}
+
+/* gemm on a layer that defaulted to another algorithm still wants packed filters */
+void set_convolutional_algorithm(convolutional_layer *l, CONV_ALGORITHM a)
+{
+    l->algorithm = a;
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    if(a == CONV_GEMM && !l->packed_weights && !l->binary && !l->xnor){
+        pack_convolutional_weights(l);
+    }
+}
+
+CONV_ALGORITHM get_convolutional_algorithm(char *s)
+{
+    if (strcmp(s, "gemm")==0) return CONV_GEMM;
+    if (strcmp(s, "winograd")==0) return CONV_WINOGRAD;
+    if (strcmp(s, "sparse")==0) return CONV_SPARSE;
+    if (strcmp(s, "depthwise")==0) return CONV_DEPTHWISE;
+    return CONV_DEFAULT;
+}
+
+char *get_convolutional_algorithm_string(CONV_ALGORITHM a)
+{
+    switch(a){
+        case CONV_GEMM:
+            return "gemm";
+        case CONV_WINOGRAD:
+            return "winograd";
+        case CONV_SPARSE:
+            return "sparse";
+        case CONV_DEPTHWISE:
+            return "depthwise";
+        default:
+            return "default";
+    }
+}
+
+/*
+ * Interleaved input and output: C[pixel][filter] = im2col(im) * W^T, the
+ * im2col rows gathered a block at a time into the workspace (1x1 stride 1
+ * convolutions read the input directly). Batchnorm is folded beforehand.
+ */
+static void forward_convolutional_layer_nhwc(convolutional_layer l, network net)
 {
     int i, j;
+    int n = l.out_w*l.out_h;
+    int k = l.size*l.size*l.c;
+    int rows = conv_col_block(l);
+    int direct = l.size == 1 && l.stride == 1 && l.pad == 0;
+
+    int fuse = gemm_epilogue_supported(l.activation);
+    layer *shortcut = 0;
+    if(fuse && net.index + 1 < net.n && net.layers[net.index + 1].fused){
+        shortcut = net.layers + net.index + 1;
+    }
+
+    for(i = 0; i < l.batch; ++i){
+        gemm_epilogue ep = {0};
+        ep.col_bias = l.biases;
+        ep.activation = l.activation;
+        float *im = net.input + i*l.inputs;
+        float *c = l.output + i*l.outputs;
+        if(direct){
+            if(shortcut){
+                ep.residual = net.layers[shortcut->index].output + i*shortcut->outputs;
+                ep.ldr = l.n;
+                ep.residual_activation = shortcut->activation;
+            }
+            gemm_packed_cpu(0,1,n,l.n,k,im,k,0,l.weights,k,l.nhwc_weights,c,l.n, fuse ? &ep : 0);
+            continue;
+        }
+        for(j = 0; j < n; j += rows){
+            int nr = (n - j < rows) ? n - j : rows;
+            im2col_nhwc_rows_cpu(im, l.c, l.h, l.w, l.size, l.stride, l.pad, j, nr, net.workspace);
+            if(shortcut){
+                ep.residual = net.layers[shortcut->index].output + i*shortcut->outputs + (size_t)j*l.n;
+                ep.ldr = l.n;
+                ep.residual_activation = shortcut->activation;
+            }
+            gemm_packed_cpu(0,1,nr,l.n,k,net.workspace,k,0,l.weights,k,l.nhwc_weights,c + (size_t)j*l.n,l.n, fuse ? &ep : 0);
+        }
+    }
+
+    if(!fuse){
+        add_bias(l.output, l.biases, l.batch*n, l.n, 1);
+        activate_array(l.output, l.outputs*l.batch, l.activation);
+    }
+}
+
+void forward_convolutional_layer(convolutional_layer l, network net)
+{
+    int i;
 
     fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+    if(net.nhwc){
+        forward_convolutional_layer_nhwc(l, net);
+        return;
+    }
 
-    if(l.xnor){
+    // inference on xnor layers runs on packed sign bits
+    int bits = l.bit_weights && !net.train;
+    if(l.xnor && !bits){
         binarize_weights(l.weights, l.n, l.c/l.groups*l.size*l.size, l.binary_weights);
         swap_binary(&l);
         binarize_cpu(net.input, l.c*l.h*l.w*l.batch, l.binary_input);
@@ -458,35 +752,79 @@ void forward_convolutional_layer(convolutional_layer l, network net)
     int m = l.n/l.groups;
     int k = l.size*l.size*l.c/l.groups;
     int n = l.out_w*l.out_h;
-    for(i = 0; i < l.batch; ++i){
-        for(j = 0; j < l.groups; ++j){
-            float *a = l.weights + j*l.nweights/l.groups;
-            float *b = net.workspace;
-            float *c = l.output + (i*l.groups + j)*n*m;
-            float *im =  net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
+    CONV_ALGORITHM algorithm = convolutional_algorithm(l);
+    if(net.train && algorithm != CONV_DEPTHWISE) algorithm = CONV_GEMM;
+    // updates don't refresh the packed filters, training packs its own
+    float *packed = net.train ? 0 : l.packed_weights;
+
+    // bias and activation (and a fused shortcut) run on each output tile
+    int fuse = !l.batch_normalize && gemm_epilogue_supported(l.activation);
+    layer *shortcut = 0;
+    if(fuse && net.index + 1 < net.n && net.layers[net.index + 1].fused){
+        shortcut = net.layers + net.index + 1;
+    }
 
-            if (l.size == 1) {
-                b = im;
-            } else {
-                im2col_cpu(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b);
-            }
-            gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+    for(i = 0; i < l.batch; ++i){
+        gemm_epilogue ep = {0};
+        ep.bias = l.biases;
+        ep.activation = l.activation;
+        if(shortcut){
+            ep.residual = net.layers[shortcut->index].output + i*shortcut->outputs;
+            ep.ldr = n;
+            ep.residual_activation = shortcut->activation;
+        }
+        if(bits){
+            xnor_convolve(l, net.input + i*l.inputs, fuse ? &ep : 0, l.output + i*l.outputs);
+            continue;
+        }
+        if(l.quant_weights && !net.train){
+            convolve_int8(l, net.input + i*l.inputs, fuse ? &ep : 0, l.output + i*l.outputs);
+            continue;
+        }
+        float *im = net.input + i*l.inputs;
+        float *c = l.output + i*l.outputs;
+        switch(algorithm){
+            case CONV_SPARSE:
+                sparse_conv_cpu(l.sparse_weights, im, l.c, l.h, l.w,
+                        l.size, l.stride, l.pad, c, fuse ? &ep : 0);
+                break;
+            case CONV_WINOGRAD:
+                winograd_convolve(im, l.c, l.h, l.w, l.pad,
+                        l.winograd_weights, l.n, l.out_h, l.out_w,
+                        net.workspace, fuse ? &ep : 0, c);
+                break;
+            case CONV_DEPTHWISE:
+                depthwise_convolve(im, l.c, l.h, l.w, l.weights, l.n,
+                        l.size, l.stride, l.pad, l.out_h, l.out_w,
+                        fuse ? &ep : 0, c);
+                break;
+            default:
+                if(l.groups > 1){
+                    gemm_grouped_im2col_cpu(l.groups, m, 1, l.weights, k, packed,
+                            im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad,
+                            c, n, fuse ? &ep : 0);
+                } else if (l.size == 1) {
+                    gemm_packed_cpu(0,0,m,n,k,l.weights,k,packed,im,n,0,c,n, fuse ? &ep : 0);
+                } else {
+                    gemm_im2col_cpu(m, 1, l.weights, k, packed, im, l.c, l.h, l.w, l.size, l.stride, l.pad, c, n, fuse ? &ep : 0);
+                }
         }
     }
 
-    if(l.batch_normalize){
-        forward_batchnorm_layer(l, net);
-    } else {
-        add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+    if(!fuse){
+        if(l.batch_normalize){
+            forward_batchnorm_layer(l, net);
+        } else {
+            add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+        }
+        activate_array(l.output, l.outputs*l.batch, l.activation);
     }
-
-    activate_array(l.output, l.outputs*l.batch, l.activation);
     if(l.binary || l.xnor) swap_binary(&l);
 }
 
 void backward_convolutional_layer(convolutional_layer l, network net)
 {
-    int i, j;
+    int i, j, s;
     int m = l.n/l.groups;
     int n = l.size*l.size*l.c/l.groups;
     int k = l.out_w*l.out_h;
@@ -509,26 +847,24 @@ void backward_convolutional_layer(convolutional_layer l, network net)
             float *imd = net.delta + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
 
             if(l.size == 1){
-                b = im;
-            } else {
-                im2col_cpu(im, l.c/l.groups, l.h, l.w, 
-                        l.size, l.stride, l.pad, b);
+                gemm(0,1,m,n,k,1,a,k,im,k,1,c,n);
+                if (net.delta) {
+                    gemm(1,0,n,k,m,1,l.weights + j*l.nweights/l.groups,n,a,k,0,imd,k);
+                }
+                continue;
             }
 
-            gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
-
-            if (net.delta) {
-                a = l.weights + j*l.nweights/l.groups;
-                b = l.delta + (i*l.groups + j)*m*k;
-                c = net.workspace;
-                if (l.size == 1) {
-                    c = imd;
-                }
+            int cols = conv_col_block(l);
+            for(s = 0; s < k; s += cols){
+                int ns = (k - s < cols) ? k - s : cols;
+                im2col_cols_cpu(im, l.c/l.groups, l.h, l.w, 
+                        l.size, l.stride, l.pad, s, ns, b);
 
-                gemm(1,0,n,k,m,1,a,n,b,k,0,c,k);
+                gemm(0,1,m,n,ns,1,a + s,k,b,ns,1,c,n);
 
-                if (l.size != 1) {
-                    col2im_cpu(net.workspace, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, imd);
+                if (net.delta) {
+                    gemm(1,0,n,ns,m,1,l.weights + j*l.nweights/l.groups,n,a + s,k,0,b,ns);
+                    col2im_cols_cpu(b, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, s, ns, imd);
                 }
             }
         }
@@ -573,6 +909,7 @@ void rgbgr_weights(convolutional_layer l)
             rgbgr_image(im);
         }
     }
+    transform_convolutional_weights(l);
 }
 
 void rescale_weights(convolutional_layer l, float scale, float trans)
@@ -586,6 +923,7 @@ void rescale_weights(convolutional_layer l, float scale, float trans)
             l.biases[i] += sum*trans;
         }
     }
+    transform_convolutional_weights(l);
 }
 
 image *get_weights(convolutional_layer l)
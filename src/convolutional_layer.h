@@ -30,6 +30,15 @@ void resize_convolutional_layer(convolutional_layer *layer, int w, int h);
 void forward_convolutional_layer(const convolutional_layer layer, network net);
 void update_convolutional_layer(convolutional_layer layer, update_args a);
 image *visualize_convolutional_layer(convolutional_layer layer, char *window, image *prev_weights);
+void transform_convolutional_weights(convolutional_layer layer);
+void fold_batchnorm_convolutional_layer(convolutional_layer *layer);
+void nhwc_convolutional_layer(convolutional_layer *layer);
+void make_convolutional_inference_weights(convolutional_layer *layer);
+int convolutional_algorithm_available(convolutional_layer layer, CONV_ALGORITHM a);
+CONV_ALGORITHM convolutional_algorithm(convolutional_layer layer);
+void set_convolutional_algorithm(convolutional_layer *layer, CONV_ALGORITHM a);
+CONV_ALGORITHM get_convolutional_algorithm(char *s);
+char *get_convolutional_algorithm_string(CONV_ALGORITHM a);
 void binarize_weights(float *weights, int n, int size, float *binary);
 void swap_binary(convolutional_layer *l);
 void binarize_weights2(float *weights, int n, int size, char *binary, float *scales);
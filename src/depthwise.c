@@ -0,0 +1,125 @@
+#include "depthwise.h"
+#include "thread_pool.h"
+#include <string.h>
+
+typedef struct{
+    float *im;
+    int c, h, w;
+    float *weights;
+    int n, size, stride, pad;
+    int out_h, out_w;
+    const gemm_epilogue *epilogue;
+    float *out;
+} depthwise_args;
+
+typedef void (*depthwise_fn)(const depthwise_args *a, int f);
+
+/*
+ * One output channel, row by row. Columns whose window lies fully inside
+ * the image take the branch-free loop (vectorized over width, with size
+ * known at compile time for 3x3 and 5x5); only the edges check bounds.
+ */
+static inline __attribute__((always_inline)) void depthwise_channel_body(const depthwise_args *a, int f, int size)
+{
+    int stride = a->stride;
+    int pad = a->pad;
+    int w = a->w;
+    int out_w = a->out_w;
+    const float *im = a->im + (size_t)(f/(a->n/a->c))*a->h*w;
+    const float *wt = a->weights + f*size*size;
+    int lo = (pad + stride - 1)/stride;
+    int hi = (w - size + pad >= 0) ? (w - size + pad)/stride + 1 : 0;
+    int oy, ky, kx, ox;
+    if(lo > out_w) lo = out_w;
+    if(hi > out_w) hi = out_w;
+    if(hi < lo) hi = lo;
+    for(oy = 0; oy < a->out_h; ++oy){
+        float *out = a->out + ((size_t)f*a->out_h + oy)*out_w;
+        memset(out, 0, out_w*sizeof(float));
+        for(ky = 0; ky < size; ++ky){
+            int iy = oy*stride - pad + ky;
+            if(iy < 0 || iy >= a->h) continue;
+            const float *row = im + (size_t)iy*w;
+            const float *k = wt + ky*size;
+            for(ox = lo; ox < hi; ++ox){
+                const float *r = row + ox*stride - pad;
+                float sum = 0;
+                for(kx = 0; kx < size; ++kx) sum += k[kx]*r[kx];
+                out[ox] += sum;
+            }
+            for(ox = 0; ox < out_w; ++ox){
+                if(ox == lo) ox = hi;
+                if(ox >= out_w) break;
+                for(kx = 0; kx < size; ++kx){
+                    int ix = ox*stride - pad + kx;
+                    if(ix >= 0 && ix < w) out[ox] += k[kx]*row[ix];
+                }
+            }
+        }
+        if(a->epilogue) gemm_epilogue_run(a->epilogue, f, oy*out_w, out, out_w);
+    }
+}
+
+static void depthwise_channel_generic(const depthwise_args *a, int f)
+{
+    if(a->size == 3) depthwise_channel_body(a, f, 3);
+    else if(a->size == 5) depthwise_channel_body(a, f, 5);
+    else depthwise_channel_body(a, f, a->size);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEPTHWISE_X86
+__attribute__((target("avx2,fma")))
+static void depthwise_channel_avx2(const depthwise_args *a, int f)
+{
+    if(a->size == 3) depthwise_channel_body(a, f, 3);
+    else if(a->size == 5) depthwise_channel_body(a, f, 5);
+    else depthwise_channel_body(a, f, a->size);
+}
+#endif
+
+static depthwise_fn depthwise_selected;
+static pthread_once_t depthwise_once = PTHREAD_ONCE_INIT;
+
+static void depthwise_select_init()
+{
+#ifdef DEPTHWISE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        depthwise_selected = depthwise_channel_avx2;
+        return;
+    }
+#endif
+    depthwise_selected = depthwise_channel_generic;
+}
+
+static depthwise_fn depthwise_select()
+{
+    pthread_once(&depthwise_once, depthwise_select_init);
+    return depthwise_selected;
+}
+
+int depthwise_supported(int c, int groups)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return groups > 1 && groups == c;
+}
+
+static void depthwise_channels(void *ptr, int begin, int end)
+{
+    depthwise_args *a = ptr;
+    depthwise_fn fn = depthwise_select();
+    int f;
+    for(f = begin; f < end; ++f) fn(a, f);
+}
+
+/* out = epilogue(conv(im)), each of the n filters reading input channel f/(n/c) */
+void depthwise_convolve(float *im, int c, int h, int w, float *weights, int n,
+        int size, int stride, int pad, int out_h, int out_w,
+        const gemm_epilogue *epilogue, float *out)
+{
+    depthwise_args a = {im, c, h, w, weights, n, size, stride, pad, out_h, out_w, epilogue, out};
+    parallel_for(n, 1, depthwise_channels, &a);
+}
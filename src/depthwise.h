@@ -0,0 +1,15 @@
+#ifndef DEPTHWISE_H
+#define DEPTHWISE_H
+#include "darknet.h"
+#include "gemm.h"
+
+/*
+ * Direct convolution for depthwise layers (one input channel per group),
+ * where the per-group GEMMs would be single rows of size*size.
+ */
+int depthwise_supported(int c, int groups);
+void depthwise_convolve(float *im, int c, int h, int w, float *weights, int n,
+        int size, int stride, int pad, int out_h, int out_w,
+        const gemm_epilogue *epilogue, float *out);
+
+#endif
@@ -1,8 +1,11 @@
 #include "gemm.h"
 #include "utils.h"
 #include "cuda.h"
+#include "thread_pool.h"
+#include "activations.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
@@ -71,76 +74,467 @@ void gemm(int TA, int TB, int M, int N, int K, float ALPHA,
     gemm_cpu( TA,  TB,  M, N, K, ALPHA,A,lda, B, ldb,BETA,C,ldc);
 }
 
-void gemm_nn(int M, int N, int K, float ALPHA, 
-        float *A, int lda, 
-        float *B, int ldb,
-        float *C, int ldc)
+/*
+ * Blocked GEMM: B is packed into KC x NC slabs of NR-wide column panels,
+ * A into MC x KC blocks of MR-high row panels (with ALPHA folded in), and
+ * an MR x NR register-tiled micro-kernel accumulates into C. The kernel is
+ * picked once at runtime from what the CPU supports.
+ */
+
+#define GEMM_KC 256
+#define GEMM_NC 4096
+#define GEMM_MC_PANELS 24
+#define GEMM_MAX_MR 6
+#define GEMM_MAX_NR 16
+
+typedef void (*gemm_kernel_fn)(int kc, const float *a, const float *b, float *c, int ldc);
+
+typedef struct{
+    const char *name;
+    int mr;
+    int nr;
+    gemm_kernel_fn kernel;
+} gemm_kernel;
+
+static void gemm_kernel_generic_4x4(int kc, const float *a, const float *b, float *c, int ldc)
 {
-    int i,j,k;
-    #pragma omp parallel for
-    for(i = 0; i < M; ++i){
-        for(k = 0; k < K; ++k){
-            register float A_PART = ALPHA*A[i*lda+k];
-            for(j = 0; j < N; ++j){
-                C[i*ldc+j] += A_PART*B[k*ldb+j];
+    float acc[4][4] = {{0}};
+    int p, i, j;
+    for(p = 0; p < kc; ++p){
+        for(i = 0; i < 4; ++i){
+            float a_part = a[i];
+            for(j = 0; j < 4; ++j){
+                acc[i][j] += a_part*b[j];
             }
         }
+        a += 4;
+        b += 4;
+    }
+    for(i = 0; i < 4; ++i){
+        for(j = 0; j < 4; ++j){
+            c[i*ldc + j] += acc[i][j];
+        }
     }
 }
 
-void gemm_nt(int M, int N, int K, float ALPHA, 
-        float *A, int lda, 
-        float *B, int ldb,
-        float *C, int ldc)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+static void gemm_kernel_sse_4x8(int kc, const float *a, const float *b, float *c, int ldc)
 {
-    int i,j,k;
-    #pragma omp parallel for
-    for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            register float sum = 0;
-            for(k = 0; k < K; ++k){
-                sum += ALPHA*A[i*lda+k]*B[j*ldb + k];
+    __m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps();
+    __m128 c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+    __m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps();
+    __m128 c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+    int p;
+    for(p = 0; p < kc; ++p){
+        __m128 b0 = _mm_loadu_ps(b);
+        __m128 b1 = _mm_loadu_ps(b + 4);
+        __m128 a0 = _mm_set1_ps(a[0]);
+        __m128 a1 = _mm_set1_ps(a[1]);
+        c00 = _mm_add_ps(c00, _mm_mul_ps(a0, b0));
+        c01 = _mm_add_ps(c01, _mm_mul_ps(a0, b1));
+        c10 = _mm_add_ps(c10, _mm_mul_ps(a1, b0));
+        c11 = _mm_add_ps(c11, _mm_mul_ps(a1, b1));
+        a0 = _mm_set1_ps(a[2]);
+        a1 = _mm_set1_ps(a[3]);
+        c20 = _mm_add_ps(c20, _mm_mul_ps(a0, b0));
+        c21 = _mm_add_ps(c21, _mm_mul_ps(a0, b1));
+        c30 = _mm_add_ps(c30, _mm_mul_ps(a1, b0));
+        c31 = _mm_add_ps(c31, _mm_mul_ps(a1, b1));
+        a += 4;
+        b += 8;
+    }
+    _mm_storeu_ps(c,             _mm_add_ps(_mm_loadu_ps(c),             c00));
+    _mm_storeu_ps(c + 4,         _mm_add_ps(_mm_loadu_ps(c + 4),         c01));
+    _mm_storeu_ps(c + ldc,       _mm_add_ps(_mm_loadu_ps(c + ldc),       c10));
+    _mm_storeu_ps(c + ldc + 4,   _mm_add_ps(_mm_loadu_ps(c + ldc + 4),   c11));
+    _mm_storeu_ps(c + 2*ldc,     _mm_add_ps(_mm_loadu_ps(c + 2*ldc),     c20));
+    _mm_storeu_ps(c + 2*ldc + 4, _mm_add_ps(_mm_loadu_ps(c + 2*ldc + 4), c21));
+    _mm_storeu_ps(c + 3*ldc,     _mm_add_ps(_mm_loadu_ps(c + 3*ldc),     c30));
+    _mm_storeu_ps(c + 3*ldc + 4, _mm_add_ps(_mm_loadu_ps(c + 3*ldc + 4), c31));
+}
+
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2_6x16(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    int p;
+    for(p = 0; p < kc; ++p){
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        __m256 a0 = _mm256_broadcast_ss(a);
+        __m256 a1 = _mm256_broadcast_ss(a + 1);
+        c00 = _mm256_fmadd_ps(a0, b0, c00);
+        c01 = _mm256_fmadd_ps(a0, b1, c01);
+        c10 = _mm256_fmadd_ps(a1, b0, c10);
+        c11 = _mm256_fmadd_ps(a1, b1, c11);
+        a0 = _mm256_broadcast_ss(a + 2);
+        a1 = _mm256_broadcast_ss(a + 3);
+        c20 = _mm256_fmadd_ps(a0, b0, c20);
+        c21 = _mm256_fmadd_ps(a0, b1, c21);
+        c30 = _mm256_fmadd_ps(a1, b0, c30);
+        c31 = _mm256_fmadd_ps(a1, b1, c31);
+        a0 = _mm256_broadcast_ss(a + 4);
+        a1 = _mm256_broadcast_ss(a + 5);
+        c40 = _mm256_fmadd_ps(a0, b0, c40);
+        c41 = _mm256_fmadd_ps(a0, b1, c41);
+        c50 = _mm256_fmadd_ps(a1, b0, c50);
+        c51 = _mm256_fmadd_ps(a1, b1, c51);
+        a += 6;
+        b += 16;
+    }
+    _mm256_storeu_ps(c,             _mm256_add_ps(_mm256_loadu_ps(c),             c00));
+    _mm256_storeu_ps(c + 8,         _mm256_add_ps(_mm256_loadu_ps(c + 8),         c01));
+    _mm256_storeu_ps(c + ldc,       _mm256_add_ps(_mm256_loadu_ps(c + ldc),       c10));
+    _mm256_storeu_ps(c + ldc + 8,   _mm256_add_ps(_mm256_loadu_ps(c + ldc + 8),   c11));
+    _mm256_storeu_ps(c + 2*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + 2*ldc),     c20));
+    _mm256_storeu_ps(c + 2*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + 2*ldc + 8), c21));
+    _mm256_storeu_ps(c + 3*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + 3*ldc),     c30));
+    _mm256_storeu_ps(c + 3*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + 3*ldc + 8), c31));
+    _mm256_storeu_ps(c + 4*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + 4*ldc),     c40));
+    _mm256_storeu_ps(c + 4*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + 4*ldc + 8), c41));
+    _mm256_storeu_ps(c + 5*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + 5*ldc),     c50));
+    _mm256_storeu_ps(c + 5*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + 5*ldc + 8), c51));
+}
+#endif
+
+static gemm_kernel gemm_kernel_selected;
+static pthread_once_t gemm_kernel_once = PTHREAD_ONCE_INIT;
+
+static void gemm_select_kernel_init()
+{
+    gemm_kernel k = {0};
+    k.name = "generic";
+    k.mr = 4;
+    k.nr = 4;
+    k.kernel = gemm_kernel_generic_4x4;
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        k.name = "avx2";
+        k.mr = 6;
+        k.nr = 16;
+        k.kernel = gemm_kernel_avx2_6x16;
+    } else if(__builtin_cpu_supports("sse4.1")){
+        k.name = "sse4";
+        k.mr = 4;
+        k.nr = 8;
+        k.kernel = gemm_kernel_sse_4x8;
+    }
+#endif
+    gemm_kernel_selected = k;
+}
+
+static gemm_kernel gemm_select_kernel()
+{
+    pthread_once(&gemm_kernel_once, gemm_select_kernel_init);
+    return gemm_kernel_selected;
+}
+
+static float *gemm_alloc(size_t n)
+{
+    void *p = 0;
+    if(posix_memalign(&p, 64, n*sizeof(float))) malloc_error();
+    return p;
+}
+
+static void gemm_pack_a(int TA, int mc, int kc, int mr, float ALPHA, float *A, int lda, float *pa)
+{
+    int i, p, r;
+    for(i = 0; i < mc; i += mr){
+        int rows = (mc - i < mr) ? mc - i : mr;
+        for(p = 0; p < kc; ++p){
+            for(r = 0; r < rows; ++r){
+                float a = TA ? A[p*lda + i + r] : A[(i + r)*lda + p];
+                pa[p*mr + r] = ALPHA*a;
             }
-            C[i*ldc+j] += sum;
+            for(; r < mr; ++r) pa[p*mr + r] = 0;
         }
+        pa += mr*kc;
     }
 }
 
-void gemm_tn(int M, int N, int K, float ALPHA, 
-        float *A, int lda, 
-        float *B, int ldb,
-        float *C, int ldc)
+static void gemm_pack_b(int TB, int kc, int nc, int nr, float *B, int ldb, float *pb)
 {
-    int i,j,k;
-    #pragma omp parallel for
-    for(i = 0; i < M; ++i){
-        for(k = 0; k < K; ++k){
-            register float A_PART = ALPHA*A[k*lda+i];
-            for(j = 0; j < N; ++j){
-                C[i*ldc+j] += A_PART*B[k*ldb+j];
+    int j, p, r;
+    for(j = 0; j < nc; j += nr){
+        int cols = (nc - j < nr) ? nc - j : nr;
+        for(p = 0; p < kc; ++p){
+            if(!TB && cols == nr){
+                memcpy(pb + p*nr, B + p*ldb + j, nr*sizeof(float));
+                continue;
             }
+            for(r = 0; r < cols; ++r){
+                pb[p*nr + r] = TB ? B[(j + r)*ldb + p] : B[p*ldb + j + r];
+            }
+            for(; r < nr; ++r) pb[p*nr + r] = 0;
         }
+        pb += nr*kc;
     }
 }
 
-void gemm_tt(int M, int N, int K, float ALPHA, 
-        float *A, int lda, 
-        float *B, int ldb,
-        float *C, int ldc)
+/*
+ * Same panel layout as gemm_pack_b, but B is the im2col matrix of an image
+ * and is gathered straight from the image instead of being materialized.
+ */
+typedef struct{
+    float *im;
+    int channels, height, width;
+    int ksize, stride, pad;
+    int out_w;
+} gemm_im2col;
+
+static void gemm_pack_b_im2col(const gemm_im2col *cv, int k0, int kc, int n0, int nc, int nr, float *pb)
 {
-    int i,j,k;
-    #pragma omp parallel for
-    for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            register float sum = 0;
-            for(k = 0; k < K; ++k){
-                sum += ALPHA*A[i+k*lda]*B[k+j*ldb];
+    int j, p, r;
+    int ks = cv->ksize;
+    for(j = 0; j < nc; j += nr){
+        int cols = (nc - j < nr) ? nc - j : nr;
+        int row0 = (n0 + j) / cv->out_w;
+        int col0 = (n0 + j) % cv->out_w;
+        int one_row = col0 + cols <= cv->out_w;
+        for(p = 0; p < kc; ++p){
+            int kk = k0 + p;
+            int kx = kk % ks;
+            int ky = (kk / ks) % ks;
+            float *im = cv->im + (size_t)(kk / ks / ks)*cv->height*cv->width;
+            float *dst = pb + p*nr;
+            int y = row0*cv->stride + ky - cv->pad;
+            int x = col0*cv->stride + kx - cv->pad;
+            if(one_row && cv->stride == 1 && y >= 0 && y < cv->height && x >= 0 && x + cols <= cv->width){
+                memcpy(dst, im + y*cv->width + x, cols*sizeof(float));
+            } else {
+                int row = row0, col = col0;
+                for(r = 0; r < cols; ++r){
+                    y = row*cv->stride + ky - cv->pad;
+                    x = col*cv->stride + kx - cv->pad;
+                    dst[r] = (y >= 0 && y < cv->height && x >= 0 && x < cv->width) ? im[y*cv->width + x] : 0;
+                    if(++col == cv->out_w){
+                        col = 0;
+                        ++row;
+                    }
+                }
             }
-            C[i*ldc+j] += sum;
+            for(r = cols; r < nr; ++r) dst[r] = 0;
         }
+        pb += nr*kc;
     }
 }
 
+int gemm_epilogue_supported(ACTIVATION a)
+{
+    return a == LINEAR || a == LEAKY || a == LOGISTIC || a == RELU;
+}
+
+/* c[0..n) holds row 'row', columns col..col+n-1 of the output */
+void gemm_epilogue_run(const gemm_epilogue *e, int row, int col, float *c, int n)
+{
+    int i;
+    if(e->bias){
+        float b = e->bias[row];
+        for(i = 0; i < n; ++i) c[i] += b;
+    }
+    if(e->col_bias){
+        float *b = e->col_bias + col;
+        for(i = 0; i < n; ++i) c[i] += b[i];
+    }
+    activate_array_serial(c, n, e->activation);
+    if(e->residual){
+        float *r = e->residual + (size_t)row*e->ldr + col;
+        for(i = 0; i < n; ++i) c[i] += r[i];
+        activate_array_serial(c, n, e->residual_activation);
+    }
+}
+
+/* row0/col0 locate C in the full output, for the epilogue */
+static void gemm_macro_kernel(gemm_kernel k, int mc, int nc, int kc, float *pa, float *pb, float *C, int ldc,
+        const gemm_epilogue *ep, int row0, int col0)
+{
+    float tile[GEMM_MAX_MR*GEMM_MAX_NR];
+    int i, j, r, s;
+    for(j = 0; j < nc; j += k.nr){
+        int cols = (nc - j < k.nr) ? nc - j : k.nr;
+        for(i = 0; i < mc; i += k.mr){
+            int rows = (mc - i < k.mr) ? mc - i : k.mr;
+            float *c = C + i*ldc + j;
+            if(rows == k.mr && cols == k.nr){
+                k.kernel(kc, pa + i*kc, pb + j*kc, c, ldc);
+            } else {
+                memset(tile, 0, sizeof(tile));
+                k.kernel(kc, pa + i*kc, pb + j*kc, tile, k.nr);
+                for(r = 0; r < rows; ++r){
+                    for(s = 0; s < cols; ++s){
+                        c[r*ldc + s] += tile[r*k.nr + s];
+                    }
+                }
+            }
+            if(ep){
+                for(r = 0; r < rows; ++r){
+                    gemm_epilogue_run(ep, row0 + i + r, col0 + j, c + r*ldc, cols);
+                }
+            }
+        }
+    }
+}
+
+typedef struct{
+    gemm_kernel k;
+    int TA, TB;
+    int M, N, K;
+    float ALPHA;
+    float *A;
+    int lda;
+    float *B;
+    int ldb;
+    float *C;
+    int ldc;
+    int tile_m, tile_n;
+    int tiles_n;
+    const gemm_im2col *im2col;
+    float *packed_a;
+    float *packed_b;
+    const gemm_epilogue *epilogue;
+} gemm_args;
+
+static void gemm_tile(gemm_args *g, int m0, int m1, int n0, int n1)
+{
+    gemm_kernel k = g->k;
+    int mc_max = GEMM_MC_PANELS*k.mr;
+    int kc_max = (g->K < GEMM_KC) ? g->K : GEMM_KC;
+    int nc_max = (n1 - n0 < GEMM_NC) ? n1 - n0 : GEMM_NC;
+    int mpad = ((g->M + k.mr - 1)/k.mr)*k.mr;
+    int npad = ((g->N + k.nr - 1)/k.nr)*k.nr;
+    float *pa = g->packed_a ? 0 : gemm_alloc((size_t)(mc_max + k.mr)*kc_max);
+    float *pb = g->packed_b ? 0 : gemm_alloc((size_t)(nc_max + k.nr)*kc_max);
+
+    int jc, pc, ic;
+    for(jc = n0; jc < n1; jc += GEMM_NC){
+        int nc = (n1 - jc < GEMM_NC) ? n1 - jc : GEMM_NC;
+        for(pc = 0; pc < g->K; pc += GEMM_KC){
+            int kc = (g->K - pc < GEMM_KC) ? g->K - pc : GEMM_KC;
+            if(g->packed_b){
+                pb = g->packed_b + (size_t)pc*npad + (size_t)jc*kc;
+            } else if(g->im2col){
+                gemm_pack_b_im2col(g->im2col, pc, kc, jc, nc, k.nr, pb);
+            } else {
+                float *b = g->TB ? g->B + jc*g->ldb + pc : g->B + pc*g->ldb + jc;
+                gemm_pack_b(g->TB, kc, nc, k.nr, b, g->ldb, pb);
+            }
+            for(ic = m0; ic < m1; ic += mc_max){
+                int mc = (m1 - ic < mc_max) ? m1 - ic : mc_max;
+                if(g->packed_a){
+                    pa = g->packed_a + (size_t)pc*mpad + (size_t)ic*kc;
+                } else {
+                    float *a = g->TA ? g->A + pc*g->lda + ic : g->A + ic*g->lda + pc;
+                    gemm_pack_a(g->TA, mc, kc, k.mr, g->ALPHA, a, g->lda, pa);
+                }
+                gemm_macro_kernel(k, mc, nc, kc, pa, pb, g->C + ic*g->ldc + jc, g->ldc,
+                        (pc + kc == g->K) ? g->epilogue : 0, ic, jc);
+            }
+        }
+    }
+    if(!g->packed_a) free(pa);
+    if(!g->packed_b) free(pb);
+}
+
+static void gemm_tiles(void *ptr, int begin, int end)
+{
+    gemm_args *g = ptr;
+    int t;
+    for(t = begin; t < end; ++t){
+        int m0 = (t / g->tiles_n)*g->tile_m;
+        int n0 = (t % g->tiles_n)*g->tile_n;
+        int m1 = (m0 + g->tile_m < g->M) ? m0 + g->tile_m : g->M;
+        int n1 = (n0 + g->tile_n < g->N) ? n0 + g->tile_n : g->N;
+        gemm_tile(g, m0, m1, n0, n1);
+    }
+}
+
+/* a couple of tiles per thread */
+static int gemm_tile_target()
+{
+    int target = get_cpu_threads();
+    return (target > 1) ? 2*target : 1;
+}
+
+/*
+ * Cut C into a grid of about target tiles, splitting whichever of M or N
+ * currently has the larger tile extent so small-M or small-N layers still
+ * spread over all cores.
+ */
+static void gemm_partition(gemm_args *g, int target)
+{
+    int panels_m = (g->M + g->k.mr - 1)/g->k.mr;
+    int panels_n = (g->N + g->k.nr - 1)/g->k.nr;
+    int tm = 1, tn = 1;
+    while(tm*tn < target){
+        int can_m = tm < panels_m;
+        int can_n = tn < panels_n;
+        if(!can_m && !can_n) break;
+        if(can_m && (!can_n || (double)g->M/tm >= (double)g->N/tn)) ++tm;
+        else ++tn;
+    }
+    g->tile_m = ((panels_m + tm - 1)/tm)*g->k.mr;
+    g->tile_n = ((panels_n + tn - 1)/tn)*g->k.nr;
+    g->tiles_n = (g->N + g->tile_n - 1)/g->tile_n;
+}
+
+/*
+ * Whole-matrix versions of the panel packing done inside gemm_tile, so a
+ * constant operand (layer weights) can be packed once and handed to
+ * gemm_packed_cpu. The layout is tied to the kernel picked at runtime.
+ */
+size_t gemm_packed_a_size(int M, int K)
+{
+    gemm_kernel k = gemm_select_kernel();
+    return (size_t)((M + k.mr - 1)/k.mr)*k.mr*K;
+}
+
+size_t gemm_packed_b_size(int N, int K)
+{
+    gemm_kernel k = gemm_select_kernel();
+    return (size_t)((N + k.nr - 1)/k.nr)*k.nr*K;
+}
+
+void gemm_prepack_a(int TA, int M, int K, float *A, int lda, float *packed)
+{
+    gemm_kernel k = gemm_select_kernel();
+    int mpad = ((M + k.mr - 1)/k.mr)*k.mr;
+    int pc;
+    for(pc = 0; pc < K; pc += GEMM_KC){
+        int kc = (K - pc < GEMM_KC) ? K - pc : GEMM_KC;
+        float *a = TA ? A + pc*lda : A + pc;
+        gemm_pack_a(TA, M, kc, k.mr, 1, a, lda, packed + (size_t)pc*mpad);
+    }
+}
+
+void gemm_prepack_b(int TB, int N, int K, float *B, int ldb, float *packed)
+{
+    gemm_kernel k = gemm_select_kernel();
+    int npad = ((N + k.nr - 1)/k.nr)*k.nr;
+    int pc;
+    for(pc = 0; pc < K; pc += GEMM_KC){
+        int kc = (K - pc < GEMM_KC) ? K - pc : GEMM_KC;
+        float *b = TB ? B + pc : B + pc*ldb;
+        gemm_pack_b(TB, kc, N, k.nr, b, ldb, packed + (size_t)pc*npad);
+    }
+}
+
+static void gemm_run(gemm_args *g)
+{
+    g->k = gemm_select_kernel();
+    gemm_partition(g, gemm_tile_target());
+    int tiles = ((g->M + g->tile_m - 1)/g->tile_m)*g->tiles_n;
+    parallel_for(tiles, 1, gemm_tiles, g);
+}
 
 void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A, int lda, 
@@ -150,19 +544,161 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
 {
     //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
     int i, j;
-    for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            C[i*ldc + j] *= BETA;
+    if(BETA != 1){
+        for(i = 0; i < M; ++i){
+            for(j = 0; j < N; ++j){
+                C[i*ldc + j] = (BETA == 0) ? 0 : C[i*ldc + j]*BETA;
+            }
+        }
+    }
+    if(M <= 0 || N <= 0 || K <= 0 || ALPHA == 0) return;
+
+    gemm_args g = {0};
+    g.TA = TA;
+    g.TB = TB;
+    g.M = M;
+    g.N = N;
+    g.K = K;
+    g.ALPHA = ALPHA;
+    g.A = A;
+    g.lda = lda;
+    g.B = B;
+    g.ldb = ldb;
+    g.C = C;
+    g.ldc = ldc;
+    gemm_run(&g);
+}
+
+/*
+ * C += A*B where either operand may come pre-packed (from gemm_prepack_a/b);
+ * a non-null packed_a/packed_b is used in place of A/B. A non-null epilogue
+ * is run on each finished tile of C.
+ */
+void gemm_packed_cpu(int TA, int TB, int M, int N, int K,
+        float *A, int lda, float *packed_a,
+        float *B, int ldb, float *packed_b,
+        float *C, int ldc, const gemm_epilogue *epilogue)
+{
+    if(M <= 0 || N <= 0 || K <= 0) return;
+
+    gemm_args g = {0};
+    g.TA = TA;
+    g.TB = TB;
+    g.M = M;
+    g.N = N;
+    g.K = K;
+    g.ALPHA = 1;
+    g.A = A;
+    g.lda = lda;
+    g.packed_a = packed_a;
+    g.B = B;
+    g.ldb = ldb;
+    g.packed_b = packed_b;
+    g.C = C;
+    g.ldc = ldc;
+    g.epilogue = epilogue;
+    gemm_run(&g);
+}
+
+/*
+ * C += ALPHA * A * im2col(im), without building the im2col matrix: each
+ * thread gathers the image patches for its own B panels as it packs them.
+ * A non-null packed_a (packed with ALPHA folded in) replaces A.
+ */
+void gemm_im2col_cpu(int M, float ALPHA,
+        float *A, int lda, float *packed_a,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *epilogue)
+{
+    int out_h = (height + 2*pad - ksize)/stride + 1;
+    int out_w = (width + 2*pad - ksize)/stride + 1;
+    int N = out_h*out_w;
+    int K = channels*ksize*ksize;
+    if(M <= 0 || N <= 0 || K <= 0 || ALPHA == 0) return;
+
+    gemm_im2col cv = {im, channels, height, width, ksize, stride, pad, out_w};
+    gemm_args g = {0};
+    g.M = M;
+    g.N = N;
+    g.K = K;
+    g.ALPHA = ALPHA;
+    g.A = A;
+    g.lda = lda;
+    g.packed_a = packed_a;
+    g.C = C;
+    g.ldc = ldc;
+    g.im2col = &cv;
+    g.epilogue = epilogue;
+    gemm_run(&g);
+}
+
+typedef struct{
+    gemm_args *g;
+    int tiles;
+} gemm_group_args;
+
+static void gemm_group_tiles(void *ptr, int begin, int end)
+{
+    gemm_group_args *a = ptr;
+    int t;
+    for(t = begin; t < end; ++t){
+        gemm_tiles(a->g + t/a->tiles, t%a->tiles, t%a->tiles + 1);
+    }
+}
+
+/*
+ * gemm_im2col_cpu for all groups of a grouped convolution in one parallel
+ * pass, so narrow groups don't each pay for their own fork and join.
+ * Group j uses A + j*M*lda (or its block of packed_a), the channels
+ * starting at j*channels, and C + j*M*ldc. The epilogue bias and residual
+ * are offset to match.
+ */
+void gemm_grouped_im2col_cpu(int groups, int M, float ALPHA,
+        float *A, int lda, float *packed_a,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *epilogue)
+{
+    int out_h = (height + 2*pad - ksize)/stride + 1;
+    int out_w = (width + 2*pad - ksize)/stride + 1;
+    int N = out_h*out_w;
+    int K = channels*ksize*ksize;
+    int target = (gemm_tile_target() + groups - 1)/groups;
+    int j;
+    if(groups <= 0 || M <= 0 || N <= 0 || K <= 0 || ALPHA == 0) return;
+
+    gemm_im2col *cv = calloc(groups, sizeof(gemm_im2col));
+    gemm_epilogue *ep = calloc(groups, sizeof(gemm_epilogue));
+    gemm_args *g = calloc(groups, sizeof(gemm_args));
+    gemm_kernel k = gemm_select_kernel();
+    for(j = 0; j < groups; ++j){
+        gemm_im2col c = {im + (size_t)j*channels*height*width, channels, height, width, ksize, stride, pad, out_w};
+        cv[j] = c;
+        g[j].k = k;
+        g[j].M = M;
+        g[j].N = N;
+        g[j].K = K;
+        g[j].ALPHA = ALPHA;
+        g[j].A = A + (size_t)j*M*lda;
+        g[j].lda = lda;
+        g[j].packed_a = packed_a ? packed_a + j*gemm_packed_a_size(M, K) : 0;
+        g[j].C = C + (size_t)j*M*ldc;
+        g[j].ldc = ldc;
+        g[j].im2col = cv + j;
+        if(epilogue){
+            ep[j] = *epilogue;
+            if(ep[j].bias) ep[j].bias += j*M;
+            if(ep[j].residual) ep[j].residual += (size_t)j*M*ep[j].ldr;
+            g[j].epilogue = ep + j;
         }
+        gemm_partition(g + j, target);
     }
-    if(!TA && !TB)
-        gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else if(TA && !TB)
-        gemm_tn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else if(!TA && TB)
-        gemm_nt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else
-        gemm_tt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+    gemm_group_args a = {g, ((M + g->tile_m - 1)/g->tile_m)*g->tiles_n};
+    parallel_for(groups*a.tiles, 1, gemm_group_tiles, &a);
+    free(cv);
+    free(ep);
+    free(g);
 }
 
 #ifdef GPU
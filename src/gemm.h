@@ -1,6 +1,26 @@
 #ifndef GEMM_H
 #define GEMM_H
 
+#include <stddef.h>
+#include "darknet.h"
+
+/*
+ * Work applied to each finished tile of C while it is still in cache:
+ * c = act(c + bias[row] + col_bias[col]); then, if residual is set,
+ * c = residual_act(c + residual[row*ldr + col]).
+ */
+typedef struct{
+    float *bias;
+    float *col_bias;
+    ACTIVATION activation;
+    float *residual;
+    int ldr;
+    ACTIVATION residual_activation;
+} gemm_epilogue;
+
+int gemm_epilogue_supported(ACTIVATION a);
+void gemm_epilogue_run(const gemm_epilogue *e, int row, int col, float *c, int n);
+
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
         float *B, int ldb,
@@ -18,6 +38,28 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+size_t gemm_packed_a_size(int M, int K);
+size_t gemm_packed_b_size(int N, int K);
+void gemm_prepack_a(int TA, int M, int K, float *A, int lda, float *packed);
+void gemm_prepack_b(int TB, int N, int K, float *B, int ldb, float *packed);
+
+void gemm_packed_cpu(int TA, int TB, int M, int N, int K,
+        float *A, int lda, float *packed_a,
+        float *B, int ldb, float *packed_b,
+        float *C, int ldc, const gemm_epilogue *epilogue);
+
+void gemm_im2col_cpu(int M, float ALPHA,
+        float *A, int lda, float *packed_a,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *epilogue);
+
+void gemm_grouped_im2col_cpu(int groups, int M, float ALPHA,
+        float *A, int lda, float *packed_a,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float *C, int ldc, const gemm_epilogue *epilogue);
+
 #ifdef GPU
 void gemm_gpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A_gpu, int lda, 
@@ -1,5 +1,6 @@
 #include "im2col.h"
 #include <stdio.h>
+#include <string.h>
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad)
 {
@@ -38,3 +39,73 @@ void im2col_cpu(float* data_im,
     }
 }
 
+
+// Columns [col0, col0 + ncols) of the im2col matrix, stored with ld ncols.
+// Walks them one output row at a time so interior runs are plain copies.
+void im2col_cols_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad,
+     int col0, int ncols, float* data_col)
+{
+    int c,i,r;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+
+    int channels_col = channels * ksize * ksize;
+    for (c = 0; c < channels_col; ++c) {
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        float *im = data_im + (size_t)c_im*height*width;
+        float *dst = data_col + (size_t)c*ncols;
+        int row = (col0) / width_col;
+        int col = (col0) % width_col;
+        for (i = 0; i < ncols; ) {
+            int run = width_col - col;
+            if (run > ncols - i) run = ncols - i;
+            int y = row*stride + h_offset - pad;
+            int x = col*stride + w_offset - pad;
+            if (y < 0 || y >= height) {
+                memset(dst + i, 0, run*sizeof(float));
+            } else if (stride == 1 && x >= 0 && x + run <= width) {
+                memcpy(dst + i, im + y*width + x, run*sizeof(float));
+            } else {
+                for (r = 0; r < run; ++r, x += stride) {
+                    dst[i + r] = (x >= 0 && x < width) ? im[y*width + x] : 0;
+                }
+            }
+            i += run;
+            col = 0;
+            ++row;
+        }
+    }
+}
+
+// Rows [row0, row0 + nrows) of the im2col matrix of an interleaved (HWC)
+// image: one row per output pixel, laid out [ksize][ksize][channels], so
+// every tap is a contiguous copy of the pixel's channels.
+void im2col_nhwc_rows_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad,
+     int row0, int nrows, float* data_col)
+{
+    int i,ky,kx;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    size_t tap = channels*sizeof(float);
+    int row = row0 / width_col;
+    int col = row0 % width_col;
+    for (i = 0; i < nrows; ++i) {
+        float *dst = data_col + (size_t)i*ksize*ksize*channels;
+        for (ky = 0; ky < ksize; ++ky) {
+            int y = row*stride + ky - pad;
+            for (kx = 0; kx < ksize; ++kx, dst += channels) {
+                int x = col*stride + kx - pad;
+                if (y < 0 || y >= height || x < 0 || x >= width) memset(dst, 0, tap);
+                else memcpy(dst, data_im + ((size_t)y*width + x)*channels, tap);
+            }
+        }
+        if (++col == width_col) {
+            col = 0;
+            ++row;
+        }
+    }
+}
@@ -5,6 +5,16 @@ void im2col_cpu(float* data_im,
         int channels, int height, int width,
         int ksize, int stride, int pad, float* data_col);
 
+void im2col_cols_cpu(float* data_im,
+        int channels, int height, int width,
+        int ksize, int stride, int pad,
+        int col0, int ncols, float* data_col);
+
+void im2col_nhwc_rows_cpu(float* data_im,
+        int channels, int height, int width,
+        int ksize, int stride, int pad,
+        int row0, int nrows, float* data_col);
+
 #ifdef GPU
 
 void im2col_gpu(float *im,
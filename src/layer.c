@@ -1,4 +1,5 @@
 #include "layer.h"
+#include "sparse.h"
 #include "cuda.h"
 
 #include <stdlib.h>
@@ -29,6 +30,15 @@ void free_layer(layer l)
     if(l.concat_delta)       free(l.concat_delta);
 
     if(l.binary_weights)     free(l.binary_weights);
+    if(l.winograd_weights)   free(l.winograd_weights);
+    if(l.packed_weights)     free(l.packed_weights);
+    if(l.bit_weights)        free(l.bit_weights);
+    if(l.bit_scales)         free(l.bit_scales);
+    if(l.sparse_weights)     free_sparse_matrix(l.sparse_weights);
+    if(l.nhwc_weights)       free(l.nhwc_weights);
+    if(l.quant_weight_scales) free(l.quant_weight_scales);
+    if(l.quant_offsets)      free(l.quant_offsets);
+    if(l.quant_weights)      free(l.quant_weights);
 
     if(l.biases)             free(l.biases);
     if(l.bias_updates)       free(l.bias_updates);
@@ -40,7 +50,7 @@ void free_layer(layer l)
     if(l.weight_updates)     free(l.weight_updates);
 
     if(l.delta)              free(l.delta);
-    if(l.output)             free(l.output);
+    if(l.output && !l.output_view) free(l.output);
     if(l.loss)               free(l.loss);
     if(l.squared)            free(l.squared);
     if(l.norms)              free(l.norms);
@@ -1,6 +1,9 @@
 #include "maxpool_layer.h"
 #include "cuda.h"
+#include "thread_pool.h"
+#include "utils.h"
 #include <stdio.h>
+#include <string.h>
 
 image get_maxpool_image(maxpool_layer l)
 {
@@ -76,9 +79,16 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     #endif
 }
 
-void forward_maxpool_layer(const maxpool_layer l, network net)
+typedef struct{
+    const maxpool_layer *l;
+    float *input;
+} maxpool_args;
+
+static void forward_maxpool_planes(void *ptr, int begin, int end)
 {
-    int b,i,j,k,m,n;
+    maxpool_args *args = ptr;
+    const maxpool_layer l = *args->l;
+    int p,i,j,m,n;
     int w_offset = -l.pad/2;
     int h_offset = -l.pad/2;
 
@@ -86,33 +96,218 @@ void forward_maxpool_layer(const maxpool_layer l, network net)
     int w = l.out_w;
     int c = l.c;
 
-    for(b = 0; b < l.batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(i = 0; i < h; ++i){
-                for(j = 0; j < w; ++j){
-                    int out_index = j + w*(i + h*(k + c*b));
-                    float max = -FLT_MAX;
-                    int max_i = -1;
-                    for(n = 0; n < l.size; ++n){
-                        for(m = 0; m < l.size; ++m){
-                            int cur_h = h_offset + i*l.stride + n;
-                            int cur_w = w_offset + j*l.stride + m;
-                            int index = cur_w + l.w*(cur_h + l.h*(k + b*l.c));
-                            int valid = (cur_h >= 0 && cur_h < l.h &&
-                                         cur_w >= 0 && cur_w < l.w);
-                            float val = (valid != 0) ? net.input[index] : -FLT_MAX;
-                            max_i = (val > max) ? index : max_i;
-                            max   = (val > max) ? val   : max;
-                        }
+    for(p = begin; p < end; ++p){
+        int b = p / c;
+        int k = p % c;
+        for(i = 0; i < h; ++i){
+            for(j = 0; j < w; ++j){
+                int out_index = j + w*(i + h*(k + c*b));
+                float max = -FLT_MAX;
+                int max_i = -1;
+                for(n = 0; n < l.size; ++n){
+                    for(m = 0; m < l.size; ++m){
+                        int cur_h = h_offset + i*l.stride + n;
+                        int cur_w = w_offset + j*l.stride + m;
+                        int index = cur_w + l.w*(cur_h + l.h*(k + b*l.c));
+                        int valid = (cur_h >= 0 && cur_h < l.h &&
+                                     cur_w >= 0 && cur_w < l.w);
+                        float val = (valid != 0) ? args->input[index] : -FLT_MAX;
+                        max_i = (val > max) ? index : max_i;
+                        max   = (val > max) ? val   : max;
                     }
-                    l.output[out_index] = max;
-                    l.indexes[out_index] = max_i;
+                }
+                l.output[out_index] = max;
+                l.indexes[out_index] = max_i;
+            }
+        }
+    }
+}
+
+typedef void (*maxpool_plane_fn)(const maxpool_layer *l, const float *in, float *out, float *tmp);
+
+/*
+ * Inference kernels for one plane, without index bookkeeping. 2x2 stride 2
+ * takes the max of each row pair and then of each column pair. Stride 1
+ * pools are separable: a horizontal window max of every input row into tmp,
+ * then a vertical window max over those rows, so a size k window costs 2k
+ * compares instead of k*k. Taps outside the image are skipped as above.
+ */
+static inline __attribute__((always_inline)) void maxpool_plane_body(const maxpool_layer *l, const float *in, float *out, float *tmp)
+{
+    int w = l->w;
+    int h = l->h;
+    int out_w = l->out_w;
+    int out_h = l->out_h;
+    int size = l->size;
+    int offset = -l->pad/2;
+    int i, j, m, n, y;
+
+    if(size == 2 && l->stride == 2 && offset == 0){
+        int full = (w/2 < out_w) ? w/2 : out_w;
+        for(i = 0; i < out_h; ++i){
+            const float *r0 = in + (size_t)2*i*w;
+            const float *r1 = (2*i + 1 < h) ? r0 + w : r0;
+            float *o = out + (size_t)i*out_w;
+            for(j = 0; j < w; ++j) tmp[j] = (r1[j] > r0[j]) ? r1[j] : r0[j];
+            for(j = 0; j < full; ++j) o[j] = (tmp[2*j+1] > tmp[2*j]) ? tmp[2*j+1] : tmp[2*j];
+            // odd width: the last window has a single column
+            for(; j < out_w; ++j) o[j] = tmp[2*j];
+        }
+        return;
+    }
+
+    if(l->stride == 1){
+        // columns whose window lies fully inside the row
+        int lo = -offset;
+        int hi = w - size - offset + 1;
+        if(lo > out_w) lo = out_w;
+        if(hi > out_w) hi = out_w;
+        if(hi < lo) hi = lo;
+        for(y = 0; y < h; ++y){
+            const float *r = in + (size_t)y*w;
+            float *t = tmp + (size_t)y*out_w;
+            for(j = lo; j < hi; ++j) t[j] = r[j + offset];
+            for(m = 1; m < size; ++m){
+                for(j = lo; j < hi; ++j) t[j] = (r[j + offset + m] > t[j]) ? r[j + offset + m] : t[j];
+            }
+            for(j = 0; j < out_w; ++j){
+                if(j == lo) j = hi;
+                if(j >= out_w) break;
+                float max = -FLT_MAX;
+                for(m = 0; m < size; ++m){
+                    int x = j + offset + m;
+                    if(x >= 0 && x < w && r[x] > max) max = r[x];
+                }
+                t[j] = max;
+            }
+        }
+        for(i = 0; i < out_h; ++i){
+            float *o = out + (size_t)i*out_w;
+            int y0 = (i + offset > 0) ? i + offset : 0;
+            int y1 = (i + offset + size < h) ? i + offset + size : h;
+            if(y0 >= y1){
+                for(j = 0; j < out_w; ++j) o[j] = -FLT_MAX;
+                continue;
+            }
+            memcpy(o, tmp + (size_t)y0*out_w, out_w*sizeof(float));
+            for(y = y0 + 1; y < y1; ++y){
+                const float *t = tmp + (size_t)y*out_w;
+                for(j = 0; j < out_w; ++j) o[j] = (t[j] > o[j]) ? t[j] : o[j];
+            }
+        }
+        return;
+    }
+
+    for(i = 0; i < out_h; ++i){
+        for(j = 0; j < out_w; ++j){
+            float max = -FLT_MAX;
+            for(n = 0; n < size; ++n){
+                int cur_h = offset + i*l->stride + n;
+                if(cur_h < 0 || cur_h >= h) continue;
+                for(m = 0; m < size; ++m){
+                    int cur_w = offset + j*l->stride + m;
+                    if(cur_w >= 0 && cur_w < w && in[(size_t)cur_h*w + cur_w] > max) max = in[(size_t)cur_h*w + cur_w];
+                }
+            }
+            out[(size_t)i*out_w + j] = max;
+        }
+    }
+}
+
+static void maxpool_plane_generic(const maxpool_layer *l, const float *in, float *out, float *tmp)
+{
+    maxpool_plane_body(l, in, out, tmp);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAXPOOL_X86
+__attribute__((target("avx2,fma")))
+static void maxpool_plane_avx2(const maxpool_layer *l, const float *in, float *out, float *tmp)
+{
+    maxpool_plane_body(l, in, out, tmp);
+}
+#endif
+
+static maxpool_plane_fn maxpool_selected;
+static pthread_once_t maxpool_once = PTHREAD_ONCE_INIT;
+
+static void maxpool_select_init()
+{
+#ifdef MAXPOOL_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        maxpool_selected = maxpool_plane_avx2;
+        return;
+    }
+#endif
+    maxpool_selected = maxpool_plane_generic;
+}
+
+static maxpool_plane_fn maxpool_select()
+{
+    pthread_once(&maxpool_once, maxpool_select_init);
+    return maxpool_selected;
+}
+
+static void forward_maxpool_planes_inference(void *ptr, int begin, int end)
+{
+    maxpool_args *args = ptr;
+    const maxpool_layer *l = args->l;
+    maxpool_plane_fn fn = maxpool_select();
+    size_t tmp_size = (size_t)l->h*l->out_w > l->w ? (size_t)l->h*l->out_w : l->w;
+    float *tmp = calloc(tmp_size, sizeof(float));
+    int p;
+    if(!tmp) malloc_error();
+    for(p = begin; p < end; ++p){
+        fn(l, args->input + (size_t)p*l->h*l->w, l->output + (size_t)p*l->out_h*l->out_w, tmp);
+    }
+    free(tmp);
+}
+
+/* interleaved layout: one output row per task, vectorized over channels */
+static void forward_maxpool_rows_nhwc(void *ptr, int begin, int end)
+{
+    maxpool_args *args = ptr;
+    const maxpool_layer l = *args->l;
+    int r,j,k,n,m;
+    int offset = -l.pad/2;
+    int c = l.c;
+
+    for(r = begin; r < end; ++r){
+        int b = r / l.out_h;
+        int i = r % l.out_h;
+        for(j = 0; j < l.out_w; ++j){
+            float *out = l.output + ((size_t)r*l.out_w + j)*c;
+            for(k = 0; k < c; ++k) out[k] = -FLT_MAX;
+            for(n = 0; n < l.size; ++n){
+                int cur_h = offset + i*l.stride + n;
+                if(cur_h < 0 || cur_h >= l.h) continue;
+                for(m = 0; m < l.size; ++m){
+                    int cur_w = offset + j*l.stride + m;
+                    if(cur_w < 0 || cur_w >= l.w) continue;
+                    const float *in = args->input + (((size_t)b*l.h + cur_h)*l.w + cur_w)*c;
+                    for(k = 0; k < c; ++k) out[k] = (in[k] > out[k]) ? in[k] : out[k];
                 }
             }
         }
     }
 }
 
+void forward_maxpool_layer(const maxpool_layer l, network net)
+{
+    maxpool_args args = {&l, net.input};
+    if(net.nhwc){
+        parallel_for(l.batch*l.out_h, 1 + 16384/(l.out_w*l.c*l.size*l.size), forward_maxpool_rows_nhwc, &args);
+        return;
+    }
+    // indexes are only needed by backward
+    if(!net.train){
+        parallel_for(l.batch*l.c, 1 + 16384/(l.out_w*l.out_h*l.size), forward_maxpool_planes_inference, &args);
+        return;
+    }
+    parallel_for(l.batch*l.c, 1 + 16384/(l.out_w*l.out_h*l.size*l.size), forward_maxpool_planes, &args);
+}
+
 void backward_maxpool_layer(const maxpool_layer l, network net)
 {
     int i;
@@ -30,6 +30,7 @@
 #include "upsample_layer.h"
 #include "shortcut_layer.h"
 #include "parser.h"
+#include "gemm.h"
 #include "data.h"
 
 load_args get_base_args(network *net)
@@ -60,6 +61,72 @@ network *load_network(const char *cfg, const char *weights, int clear)
     return net;
 }
 
+/* layers whose training state is their own and unused by the forward pass */
+static int inference_strippable(LAYER_TYPE type)
+{
+    return type == CONVOLUTIONAL || type == CONNECTED || type == BATCHNORM || type == MAXPOOL ||
+        type == AVGPOOL || type == UPSAMPLE || type == SHORTCUT || type == ROUTE || type == REORG ||
+        type == SOFTMAX || type == YOLO || type == REGION;
+}
+
+/* free the CPU buffers only backward and update use */
+static void strip_network_training(network *net)
+{
+    int i, j;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        float **buffers[] = {&l->delta, &l->weight_updates, &l->bias_updates, &l->scale_updates,
+            &l->x, &l->x_norm, &l->mean, &l->variance, &l->mean_delta, &l->variance_delta,
+            &l->m, &l->v, &l->bias_m, &l->bias_v, &l->scale_m, &l->scale_v};
+        if(!inference_strippable(l->type)) continue;
+        for(j = 0; j < sizeof(buffers)/sizeof(buffers[0]); ++j){
+            free(*buffers[j]);
+            *buffers[j] = 0;
+        }
+        // the inference maxpool kernels don't record argmaxes
+        if(l->type == MAXPOOL){
+            free(l->indexes);
+            l->indexes = 0;
+        }
+    }
+}
+
+/* the forms of the loaded weights only the CPU forward pass reads */
+static void make_network_inference_weights(network *net)
+{
+    int i;
+    size_t workspace_size = 0;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == CONVOLUTIONAL) make_convolutional_inference_weights(l);
+        if(l->type == CONNECTED) make_connected_inference_weights(l);
+        if(l->workspace_size > workspace_size) workspace_size = l->workspace_size;
+    }
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    // winograd layers can need more than their im2col blocks
+    free(net->workspace);
+    net->workspace = calloc(1, workspace_size);
+}
+
+/*
+ * Like load_network, for networks that only run forward: the deltas,
+ * updates, batchnorm statistics and optimizer moments of the layers are
+ * released right after parsing (their pages were never touched), and are
+ * released again after resize_network. The packed, winograd and sparse
+ * weights the forward pass reads are made here, once. The network can't be
+ * trained.
+ */
+network *load_network_inference(const char *cfg, const char *weights)
+{
+    network *net = load_network(cfg, weights, 0);
+    net->inference = 1;
+    strip_network_training(net);
+    make_network_inference_weights(net);
+    return net;
+}
+
 size_t get_current_batch(network *net)
 {
     size_t batch_num = (*net->seen)/(net->batch*net->subdivisions);
@@ -185,6 +252,13 @@ network *make_network(int n)
     return net;
 }
 
+/* layers whose forward pass also runs on interleaved activations */
+static int nhwc_native(LAYER_TYPE type)
+{
+    return type == CONVOLUTIONAL || type == MAXPOOL || type == UPSAMPLE ||
+        type == ROUTE || type == SHORTCUT;
+}
+
 void forward_network(network *netp)
 {
 #ifdef GPU
@@ -195,18 +269,32 @@ void forward_network(network *netp)
 #endif
     network net = *netp;
     int i;
+    net.nhwc = net.nhwc && !net.train;
+    if(net.nhwc){
+        flatten_cpu(net.input, net.h*net.w, net.c, net.batch, 1, net.nhwc_buffer);
+        net.input = net.nhwc_buffer;
+    }
     for(i = 0; i < net.n; ++i){
         net.index = i;
         layer l = net.layers[i];
         if(l.delta){
             fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
+        if(net.nhwc && !nhwc_native(l.type)){
+            flatten_cpu(net.input, l.h*l.w, l.c, l.batch, 0, net.nhwc_buffer);
+            net.input = net.nhwc_buffer;
+        }
         l.forward(l, net);
         net.input = l.output;
         if(l.truth) {
             net.truth = l.output;
         }
     }
+    if(net.nhwc && nhwc_native(net.layers[net.n-1].type)){
+        layer l = net.layers[net.n-1];
+        flatten_cpu(l.output, l.out_h*l.out_w, l.out_c, l.batch, 0, net.nhwc_buffer);
+        copy_cpu(l.outputs*l.batch, net.nhwc_buffer, 1, l.output, 1);
+    }
     calc_network_cost(netp);
 }
 
@@ -336,6 +424,393 @@ void set_temp_network(network *net, float t)
 }
 
 
+/*
+ * Inference only: merge every conv/connected batchnorm into the preceding
+ * weights so the forward pass skips normalize/scale/bias. Training the
+ * network afterwards is not supported.
+ */
+void fold_batchnorm_network(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == CONVOLUTIONAL) fold_batchnorm_convolutional_layer(l);
+        if(l->type == CONNECTED) fold_batchnorm_connected_layer(l);
+    }
+}
+
+static int layer_output_used(network *net, int index, int skip)
+{
+    int i, j;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(i == skip) continue;
+        if(l.type == SHORTCUT && l.index == index) return 1;
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                if(l.input_layers[j] == index) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Inference only: let a convolution compute the following shortcut's sum
+ * and activation in its GEMM epilogue. The convolution's output then holds
+ * the shortcut result, so this is only done when nothing else reads it.
+ */
+void fuse_shortcut_network(network *net)
+{
+    int i;
+#ifdef GPU
+    if(net->gpu_index >= 0) return;
+#endif
+    for(i = 0; i + 1 < net->n; ++i){
+        layer *l = net->layers + i;
+        layer *s = net->layers + i + 1;
+        if(l->type != CONVOLUTIONAL || s->type != SHORTCUT) continue;
+        if(l->batch_normalize || !gemm_epilogue_supported(l->activation)) continue;
+        if(!gemm_epilogue_supported(s->activation)) continue;
+        if(s->alpha != 1 || s->beta != 1 || s->index == i) continue;
+        if(s->w != s->out_w || s->h != s->out_h || s->c != s->out_c) continue;
+        if(layer_output_used(net, i, i + 1)) continue;
+        s->fused = 1;
+    }
+}
+
+/* layers that write their whole output on every forward pass and keep no state in it */
+static int transient_output(LAYER_TYPE type)
+{
+    return type == CONVOLUTIONAL || type == CONNECTED || type == MAXPOOL || type == AVGPOOL ||
+        type == UPSAMPLE || type == SHORTCUT || type == ROUTE;
+}
+
+/* may have its output moved into another buffer */
+static int movable_output(network *net, int index)
+{
+    int i;
+    layer l = net->layers[index];
+    if(l.output_view || !transient_output(l.type)) return 0;
+    // buffers shared at parse time (dropout) stay where they are
+    for(i = 0; i < net->n; ++i){
+        if(i != index && !net->layers[i].output_view && net->layers[i].output == l.output) return 0;
+    }
+    return 1;
+}
+
+/* index of the layer owning the buffer that holds layer index's output */
+static int output_owner(network *net, int index)
+{
+    int i;
+    float *p = net->layers[index].output;
+    if(!net->layers[index].output_view) return index;
+    for(i = 0; i < net->n; ++i){
+        layer o = net->layers[i];
+        if(!o.output_view && p >= o.output && p < o.output + (size_t)o.outputs*o.batch) return i;
+    }
+    return -1;
+}
+
+static void clear_network_views(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(!l->output_view) continue;
+        l->output = calloc((size_t)l->outputs*l->batch, sizeof(float));
+        if(!l->output) malloc_error();
+        l->output_view = 0;
+    }
+    free(net->arena_buffer);
+    net->arena_buffer = 0;
+    net->output = net->layers[net->n-1].output;
+}
+
+static int plan_route_views(network *net)
+{
+    int i, j, n = 0;
+    if(net->nhwc) return 0;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        size_t offset = 0;
+        if(l->type != ROUTE || l->n < 2 || l->batch != 1) continue;
+        for(j = 0; j < l->n; ++j){
+            layer *in = net->layers + l->input_layers[j];
+            if(in->type != ROUTE && movable_output(net, l->input_layers[j]) && in->outputs == l->input_sizes[j]){
+                free(in->output);
+                in->output = l->output + offset;
+                in->output_view = 1;
+                ++n;
+            }
+            offset += l->input_sizes[j];
+        }
+    }
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type != ROUTE || l->n != 1) continue;
+        layer *in = net->layers + l->input_layers[0];
+        if(in->outputs != l->outputs) continue;
+        free(l->output);
+        l->output = in->output;
+        l->output_view = 1;
+        ++n;
+    }
+    return n;
+}
+
+typedef struct{
+    int first, last;
+    size_t size, offset;
+} arena_tensor;
+
+static void arena_use(arena_tensor *t, int owner, int step)
+{
+    if(owner < 0 || !t[owner].size) return;
+    if(step < t[owner].first) t[owner].first = step;
+    if(step > t[owner].last) t[owner].last = step;
+}
+
+static size_t plan_arena(network *net)
+{
+    int i, j, k;
+    int n = net->n;
+    int out = n - 1;
+    size_t total = 0;
+    arena_tensor *t = calloc(n, sizeof(arena_tensor));
+    int *owner = calloc(n, sizeof(int));
+    int *order = calloc(n, sizeof(int));
+    ptrdiff_t *shift = calloc(n, sizeof(ptrdiff_t));
+    if(!t || !owner || !order || !shift) malloc_error();
+
+    // outputs from the network's output layer on are read after the forward pass
+    while(out > 0 && net->layers[out].type == COST) --out;
+    for(i = 0; i < n; ++i){
+        layer l = net->layers[i];
+        owner[i] = output_owner(net, i);
+        if(i >= out || !movable_output(net, i)) continue;
+        // 64 byte aligned slots
+        t[i].size = ((size_t)l.outputs*l.batch + 15)/16*16;
+        t[i].first = t[i].last = i;
+    }
+    for(i = 0; i < n; ++i){
+        layer l = net->layers[i];
+        arena_use(t, owner[i], i);
+        if(i > 0) arena_use(t, owner[i-1], i);
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j) arena_use(t, owner[l.input_layers[j]], i);
+        }
+        if(l.type == SHORTCUT) arena_use(t, owner[l.index], i);
+        // a fused shortcut's residual is added by the layer before it
+        if(i + 1 < n && net->layers[i+1].type == SHORTCUT && net->layers[i+1].fused){
+            arena_use(t, owner[net->layers[i+1].index], i);
+        }
+    }
+
+    // largest first, each at the lowest offset clear of the live ones placed so far
+    for(i = 0, k = 0; i < n; ++i){
+        if(t[i].size) order[k++] = i;
+    }
+    for(i = 0; i < k; ++i){
+        for(j = i + 1; j < k; ++j){
+            if(t[order[j]].size > t[order[i]].size){
+                int s = order[i];
+                order[i] = order[j];
+                order[j] = s;
+            }
+        }
+    }
+    for(i = 0; i < k; ++i){
+        arena_tensor *a = t + order[i];
+        int moved = 1;
+        a->offset = 0;
+        while(moved){
+            moved = 0;
+            for(j = 0; j < i; ++j){
+                arena_tensor *b = t + order[j];
+                if(a->first > b->last || b->first > a->last) continue;
+                if(a->offset < b->offset + b->size && b->offset < a->offset + a->size){
+                    a->offset = b->offset + b->size;
+                    moved = 1;
+                }
+            }
+        }
+        if(a->offset + a->size > total) total = a->offset + a->size;
+    }
+
+    if(total){
+        net->arena_buffer = calloc(total, sizeof(float));
+        if(!net->arena_buffer) malloc_error();
+        for(i = 0; i < n; ++i){
+            if(owner[i] >= 0 && t[owner[i]].size) shift[i] = net->layers[i].output - net->layers[owner[i]].output;
+        }
+        for(i = 0; i < n; ++i){
+            if(t[i].size) free(net->layers[i].output);
+        }
+        for(i = 0; i < n; ++i){
+            if(owner[i] < 0 || !t[owner[i]].size) continue;
+            net->layers[i].output = net->arena_buffer + t[owner[i]].offset + shift[i];
+            net->layers[i].output_view = 1;
+        }
+    }
+    free(t);
+    free(owner);
+    free(order);
+    free(shift);
+    return total*sizeof(float);
+}
+
+/* (re)build the enabled plans on freshly allocated layer buffers */
+static void plan_network_views(network *net, int *routes, size_t *arena)
+{
+    int n = 0;
+    size_t size = 0;
+    int cpu = 1;
+#ifdef GPU
+    cpu = net->gpu_index < 0;
+#endif
+    clear_network_views(net);
+    if(cpu && net->route_views) n = plan_route_views(net);
+    if(cpu && net->arena) size = plan_arena(net);
+    net->output = net->layers[net->n-1].output;
+    if(routes) *routes = n;
+    if(arena) *arena = size;
+}
+
+/*
+ * Inference memory plan: layers feeding a concatenating route write
+ * straight into their slice of its output, and single-input routes point at
+ * their input, so routes copy nothing. Concatenations need batch 1 (the
+ * slices are strided otherwise), and none of this applies to the NHWC
+ * layout, whose routes interleave channels. Kept across resize_network and
+ * set_batch_network. Returns the number of route inputs no longer copied.
+ */
+int set_network_route_views(network *net)
+{
+    int n;
+    net->route_views = 1;
+    plan_network_views(net, &n, 0);
+    return n;
+}
+
+/*
+ * Inference memory plan: activations that are only read during the forward
+ * pass share one arena. Each output lives from the first layer writing it
+ * to the last layer reading it (the next layer, route inputs, shortcut
+ * indexes), and buffers with disjoint lifetimes get overlapping offsets.
+ * Outputs of the network's output layer and of layers such as yolo, region
+ * or recurrent ones keep their own buffers, but intermediate outputs no
+ * longer hold their values after forward_network. Combines with the route
+ * views and the NHWC layout; kept across resize_network and
+ * set_batch_network. Returns the arena size in bytes.
+ */
+size_t set_network_arena(network *net)
+{
+    size_t size;
+    net->arena = 1;
+    plan_network_views(net, 0, &size);
+    return size;
+}
+
+/*
+ * Inference only: yolo layers activate just the objectness in forward, and
+ * get_network_boxes decodes boxes and class probabilities for the cells
+ * above the threshold only. The other entries of their outputs stay raw.
+ * CPU forward passes only; flipped (batch 2) pairs are fully activated
+ * before they are averaged.
+ */
+void set_network_lazy_decode(network *net, int lazy)
+{
+    int i;
+#ifdef GPU
+    // the GPU forward pass activates the whole output
+    lazy = 0;
+#endif
+    for(i = 0; i < net->n; ++i){
+        if(net->layers[i].type == YOLO) net->layers[i].lazy_decode = lazy;
+    }
+}
+
+/*
+ * Bounds the work after the forward pass on crowded frames: get_network_boxes
+ * returns at most per_image yolo boxes, those with the highest objectness,
+ * and keeps each class in at most per_class boxes, those most probable for
+ * it. Region and detection layers always return all their cells. Zero or
+ * less lifts a cap.
+ */
+void set_network_max_candidates(network *net, int per_image, int per_class)
+{
+    net->max_candidates = per_image;
+    net->max_class_candidates = per_class;
+}
+
+static int nhwc_head(LAYER_TYPE type)
+{
+    return type == YOLO || type == REGION;
+}
+
+static int nhwc_layer_supported(network *net, int i)
+{
+    int j;
+    layer l = net->layers[i];
+    if(i > 0 && nhwc_head(net->layers[i-1].type) && l.type != ROUTE) return 0;
+    switch(l.type){
+        case CONVOLUTIONAL:
+            return l.groups == 1 && !l.binary && !l.xnor && !l.quant_weights;
+        case MAXPOOL:
+            return 1;
+        case UPSAMPLE:
+            return !l.reverse;
+        case ROUTE:
+            for(j = 0; j < l.n; ++j){
+                layer in = net->layers[l.input_layers[j]];
+                if(nhwc_head(in.type) || in.out_w != l.out_w || in.out_h != l.out_h) return 0;
+            }
+            return 1;
+        case SHORTCUT:
+            return !nhwc_head(net->layers[l.index].type) &&
+                l.w == l.out_w && l.h == l.out_h && l.c == l.out_c;
+        case YOLO:
+        case REGION:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Inference only: run the CPU forward pass on interleaved (HWC) activations,
+ * so convolutions become GEMMs over contiguous pixel rows. The input is
+ * converted once, and the inputs of yolo/region layers (and the last
+ * output) are converted back. Folds batchnorm. Returns 0 and leaves the
+ * network planar when a layer has no interleaved implementation.
+ * Call again after changing the batch size.
+ */
+int set_network_nhwc(network *net)
+{
+    int i;
+    size_t size = (size_t)net->inputs*net->batch;
+#ifdef GPU
+    if(net->gpu_index >= 0) return 0;
+#endif
+    for(i = 0; i < net->n; ++i){
+        if(!nhwc_layer_supported(net, i)) return 0;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == CONVOLUTIONAL) nhwc_convolutional_layer(l);
+        if(nhwc_head(l->type) && (size_t)l->inputs*l->batch > size) size = (size_t)l->inputs*l->batch;
+    }
+    if((size_t)net->layers[net->n-1].outputs*net->batch > size) size = (size_t)net->layers[net->n-1].outputs*net->batch;
+    free(net->nhwc_buffer);
+    net->nhwc_buffer = calloc(size, sizeof(float));
+    if(!net->nhwc_buffer) malloc_error();
+    net->nhwc = 1;
+    // drops the route views, interleaved routes concatenate per pixel
+    plan_network_views(net, 0, 0);
+    return 1;
+}
+
 void set_batch_network(network *net, int b)
 {
     net->batch = b;
@@ -353,6 +828,7 @@ void set_batch_network(network *net, int b)
         }
 #endif
     }
+    if(net->route_views || net->arena) plan_network_views(net, 0, 0);
 }
 
 int resize_network(network *net, int w, int h)
@@ -362,6 +838,8 @@ int resize_network(network *net, int w, int h)
     cuda_free(net->workspace);
 #endif
     int i;
+    // layers are resized on their own buffers, the plans are redone below
+    clear_network_views(net);
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
     net->h = h;
@@ -433,6 +911,8 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = calloc(1, workspace_size);
 #endif
+    if(net->inference) strip_network_training(net);
+    if(net->route_views || net->arena) plan_network_views(net, 0, 0);
     //fprintf(stderr, " Done!\n");
     return 0;
 }
@@ -507,20 +987,74 @@ float *network_predict(network *net, float *input)
     return out;
 }
 
-int num_detections(network *net, float thresh)
+/*
+ * Output layer l as seen when decoding image b of a batch of separate
+ * images: a batch of one at that image's slot. Below zero the whole batch,
+ * where batch 2 outputs are a flipped pair.
+ */
+static layer box_layer(layer l, int b)
+{
+    if(b < 0) return l;
+    l.output += (size_t)b*l.outputs;
+    l.batch = 1;
+    return l;
+}
+
+/*
+ * With net->max_candidates set and more yolo cells above thresh, the
+ * objectness of the max_candidates-th best: cells above cut are kept, and
+ * the first ties equal to it. Returns 0 when nothing is capped. Flipped
+ * (batch 2) yolo outputs are only averaged while decoding, so aren't capped.
+ */
+static int network_box_cut(network *net, int b, float thresh, float *cut, int *ties)
+{
+    int i, n = 0, above = 0;
+    int k = net->max_candidates;
+    if(k <= 0) return 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = box_layer(net->layers[i], b);
+        if(l.type != YOLO) continue;
+        if(l.batch == 2) return 0;
+        n += yolo_num_detections(l, thresh);
+    }
+    if(n <= k) return 0;
+    float *objectness = calloc(n, sizeof(float));
+    if(!objectness) malloc_error();
+    n = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = box_layer(net->layers[i], b);
+        if(l.type == YOLO) n += yolo_candidates(l, thresh, objectness + n);
+    }
+    *cut = nth_largest(objectness, n, k - 1);
+    for(i = 0; i < n; ++i) above += objectness[i] > *cut;
+    *ties = k - above;
+    free(objectness);
+    return 1;
+}
+
+static int count_network_boxes(network *net, int b, float thresh)
 {
     int i;
     int s = 0;
+    int yolo = 0, flipped = 0;
     for(i = 0; i < net->n; ++i){
-        layer l = net->layers[i];
+        layer l = box_layer(net->layers[i], b);
         if(l.type == YOLO){
-            s += yolo_num_detections(l, thresh);
+            yolo += yolo_num_detections(l, thresh);
+            flipped |= l.batch == 2;
         }
         if(l.type == DETECTION || l.type == REGION){
             s += l.w*l.h*l.n;
         }
     }
-    return s;
+    // see network_box_cut
+    if(net->max_candidates > 0 && !flipped && yolo > net->max_candidates) yolo = net->max_candidates;
+    return s + yolo;
+}
+
+int num_detections(network *net, float thresh)
+{
+    return count_network_boxes(net, -1, thresh);
 }
 
 detection *make_network_boxes(network *net, float thresh, int *num)
@@ -539,13 +1073,42 @@ detection *make_network_boxes(network *net, float thresh, int *num)
     return dets;
 }
 
-void fill_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
+/* zeroes each class in all but its max_class_candidates most probable boxes */
+static void cap_class_boxes(detection *dets, int n, int classes, int k)
+{
+    int i, j;
+    float *probs = calloc(n, sizeof(float));
+    if(!probs) malloc_error();
+    for(j = 0; j < classes; ++j){
+        int m = 0, above = 0;
+        for(i = 0; i < n; ++i){
+            if(dets[i].prob[j] != 0) probs[m++] = dets[i].prob[j];
+        }
+        if(m <= k) continue;
+        float cut = nth_largest(probs, m, k - 1);
+        for(i = 0; i < m; ++i) above += probs[i] > cut;
+        int ties = k - above;
+        for(i = 0; i < n; ++i){
+            float p = dets[i].prob[j];
+            if(p == 0 || p > cut) continue;
+            if(p == cut && ties > 0) --ties;
+            else dets[i].prob[j] = 0;
+        }
+    }
+    free(probs);
+}
+
+static void fill_boxes(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
 {
     int j;
+    detection *first = dets;
+    float cut = -FLT_MAX;
+    int ties = 0;
+    network_box_cut(net, b, thresh, &cut, &ties);
     for(j = 0; j < net->n; ++j){
-        layer l = net->layers[j];
+        layer l = box_layer(net->layers[j], b);
         if(l.type == YOLO){
-            int count = get_yolo_detections(l, w, h, net->w, net->h, thresh, map, relative, dets);
+            int count = get_yolo_detections_cut(l, w, h, net->w, net->h, thresh, cut, &ties, map, relative, dets);
             dets += count;
         }
         if(l.type == REGION){
@@ -557,6 +1120,14 @@ void fill_network_boxes(network *net, int w, int h, float thresh, float hier, in
             dets += l.w*l.h*l.n;
         }
     }
+    if(net->max_class_candidates > 0 && dets > first){
+        cap_class_boxes(first, dets - first, net->layers[net->n - 1].classes, net->max_class_candidates);
+    }
+}
+
+void fill_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets)
+{
+    fill_boxes(net, -1, w, h, thresh, hier, map, relative, dets);
 }
 
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num)
@@ -576,6 +1147,77 @@ void free_detections(detection *dets, int n)
     free(dets);
 }
 
+static void reserve_detection_buffer(detection_buffer *buf, int n, int classes, int masks)
+{
+    int size = buf->size;
+    if(n <= size && classes == buf->classes && masks == buf->masks) return;
+    if(n > size) size = (n > 2*size) ? n : 2*size;
+    if(size < 16) size = 16;
+    free(buf->dets);
+    buf->dets = malloc((size_t)size*(sizeof(detection) + (classes + masks)*sizeof(float)));
+    if(!buf->dets) malloc_error();
+    buf->size = size;
+    buf->classes = classes;
+    buf->masks = masks;
+    buf->prob = (float *)(buf->dets + size);
+    buf->mask = buf->prob + (size_t)size*classes;
+}
+
+static detection *make_boxes_buffer(network *net, int nboxes, detection_buffer *buf)
+{
+    layer l = net->layers[net->n - 1];
+    int i;
+    int masks = (l.coords > 4) ? l.coords - 4 : 0;
+    reserve_detection_buffer(buf, nboxes, l.classes, masks);
+    memset(buf->dets, 0, nboxes*sizeof(detection));
+    memset(buf->prob, 0, (size_t)nboxes*l.classes*sizeof(float));
+    memset(buf->mask, 0, (size_t)nboxes*masks*sizeof(float));
+    for(i = 0; i < nboxes; ++i){
+        buf->dets[i].prob = buf->prob + (size_t)i*l.classes;
+        if(masks) buf->dets[i].mask = buf->mask + (size_t)i*masks;
+    }
+    buf->n = nboxes;
+    return buf->dets;
+}
+
+/* make_network_boxes into buf: the same zeroed detections, without an allocation per box */
+detection *make_network_boxes_buffer(network *net, float thresh, detection_buffer *buf, int *num)
+{
+    int nboxes = num_detections(net, thresh);
+    if(num) *num = nboxes;
+    return make_boxes_buffer(net, nboxes, buf);
+}
+
+/* get_network_boxes into buf; the detections stay valid until its next use */
+detection *get_network_boxes_buffer(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection_buffer *buf, int *num)
+{
+    detection *dets = make_network_boxes_buffer(net, thresh, buf, num);
+    fill_network_boxes(net, w, h, thresh, hier, map, relative, dets);
+    return dets;
+}
+
+/*
+ * get_network_boxes_buffer for image b when the batch holds separate
+ * images, each w x h originally: batch 2 isn't taken as a flipped pair.
+ * The network is only read, except for hierarchical region outputs which
+ * are only written in image b's slot, so different images can be decoded
+ * at the same time, each into its own buf.
+ */
+detection *get_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, int *map, int relative, detection_buffer *buf, int *num)
+{
+    int nboxes = count_network_boxes(net, b, thresh);
+    detection *dets = make_boxes_buffer(net, nboxes, buf);
+    if(num) *num = nboxes;
+    fill_boxes(net, b, w, h, thresh, hier, map, relative, dets);
+    return dets;
+}
+
+void free_detection_buffer(detection_buffer *buf)
+{
+    free(buf->dets);
+    memset(buf, 0, sizeof(detection_buffer));
+}
+
 float *network_predict_image(network *net, image im)
 {
     image imr = letterbox_image(im, net->w, net->h);
@@ -746,6 +1388,8 @@ void free_network(network *net)
     if(net->seen)   free(net->seen);
     if(net->t)      free(net->t);
     if(net->cost)   free(net->cost);
+    if(net->nhwc_buffer) free(net->nhwc_buffer);
+    if(net->arena_buffer) free(net->arena_buffer);
 
     free(net);
 }
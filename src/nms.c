@@ -0,0 +1,320 @@
+#include "darknet.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// boxes tested per step of the sweep before their hits are collected
+#define NMS_BLOCK 64
+// keep inter/union a true division as in box_iou: reciprocal math may turn it into
+// inter*(1/union), and with finite math x86 expands vector division into rcpps
+#define NMS_EXACT_DIV __attribute__((optimize("no-reciprocal-math", "no-finite-math-only")))
+
+/* a candidate by its box's place in nms_boxes, pointing back at the caller's */
+typedef struct{
+    float prob;
+    int box;
+    int class_id;
+    int index;
+} nms_ref;
+
+/* boxes taking part, as struct of arrays in ascending order of left edge */
+typedef struct{
+    float *left, *right, *top, *bottom, *area;
+    int n;
+} nms_boxes;
+
+typedef struct{
+    float left;
+    int box;
+} nms_edge;
+
+typedef int (*nms_overlap_fn)(const nms_boxes *b, int i, int begin, int end, float thresh, int *hits);
+
+static int nms_edge_comparator(const void *pa, const void *pb)
+{
+    const nms_edge *a = pa;
+    const nms_edge *b = pb;
+    if(a->left != b->left) return (a->left < b->left) ? -1 : 1;
+    return a->box - b->box;
+}
+
+/* unsigned key ordering floats from largest to smallest */
+static unsigned int nms_score_key(float score)
+{
+    unsigned int u;
+    memcpy(&u, &score, sizeof(u));
+    u = (u & 0x80000000u) ? ~u : u | 0x80000000u;
+    return ~u;
+}
+
+/* stable radix sort by descending probability, 8 bits per pass, through tmp */
+static void nms_sort_refs(nms_ref *a, nms_ref *tmp, int n)
+{
+    int i, shift;
+    for(shift = 0; shift < 32; shift += 8){
+        int start[257] = {0};
+        for(i = 0; i < n; ++i) ++start[((nms_score_key(a[i].prob) >> shift) & 255) + 1];
+        for(i = 0; i < 256; ++i) start[i+1] += start[i];
+        for(i = 0; i < n; ++i) tmp[start[(nms_score_key(a[i].prob) >> shift) & 255]++] = a[i];
+        nms_ref *swap = a;
+        a = tmp;
+        tmp = swap;
+    }
+}
+
+/*
+ * Writes to hits the boxes begin..end whose IoU with box i is above thresh
+ * and returns their count. Same arithmetic as box_iou, which is symmetric,
+ * computed for a block of boxes without branches before collecting.
+ */
+static inline __attribute__((always_inline)) NMS_EXACT_DIV int nms_overlap_body(const nms_boxes *b, int i, int begin, int end, float thresh, int *hits)
+{
+    unsigned char above[NMS_BLOCK];
+    float l0 = b->left[i], r0 = b->right[i], t0 = b->top[i], d0 = b->bottom[i], a0 = b->area[i];
+    int j, s, n = 0;
+    for(s = begin; s < end; s += NMS_BLOCK){
+        int e = (end - s < NMS_BLOCK) ? end - s : NMS_BLOCK;
+        const float *left = b->left + s, *right = b->right + s, *top = b->top + s, *bottom = b->bottom + s, *area = b->area + s;
+        for(j = 0; j < e; ++j){
+            float l = (left[j] > l0) ? left[j] : l0;
+            float r = (right[j] < r0) ? right[j] : r0;
+            float t = (top[j] > t0) ? top[j] : t0;
+            float d = (bottom[j] < d0) ? bottom[j] : d0;
+            float w = r - l;
+            float h = d - t;
+            float inter = (w < 0 || h < 0) ? 0 : w*h;
+            float u = a0 + area[j] - inter;
+            above[j] = inter/u > thresh;
+        }
+        for(j = 0; j < e; ++j){
+            if(above[j]) hits[n++] = s + j;
+        }
+    }
+    return n;
+}
+
+NMS_EXACT_DIV
+static int nms_overlap_generic(const nms_boxes *b, int i, int begin, int end, float thresh, int *hits)
+{
+    return nms_overlap_body(b, i, begin, end, thresh, hits);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NMS_X86
+// no fma: a fused union would round differently from box_iou
+__attribute__((target("avx2"))) NMS_EXACT_DIV
+static int nms_overlap_avx2(const nms_boxes *b, int i, int begin, int end, float thresh, int *hits)
+{
+    return nms_overlap_body(b, i, begin, end, thresh, hits);
+}
+#endif
+
+static nms_overlap_fn nms_selected;
+static pthread_once_t nms_once = PTHREAD_ONCE_INIT;
+
+static void nms_select_init()
+{
+#ifdef NMS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        nms_selected = nms_overlap_avx2;
+        return;
+    }
+#endif
+    nms_selected = nms_overlap_generic;
+}
+
+/* the batched Detector runs nms on several threads at once */
+static nms_overlap_fn nms_select()
+{
+    pthread_once(&nms_once, nms_select_init);
+    return nms_selected;
+}
+
+/* first box at or after begin whose left edge is not left of x */
+static int nms_sweep_end(const nms_boxes *b, int begin, float x)
+{
+    int end = b->n;
+    while(begin < end){
+        int mid = begin + (end - begin)/2;
+        if(b->left[mid] < x) begin = mid + 1;
+        else end = mid;
+    }
+    return begin;
+}
+
+/*
+ * Overlap graph of the boxes, as adjacency lists in offsets/neighbours.
+ * Sorted by left edge, box i can only intersect the boxes after it that
+ * start before its right edge, so the sweep stops there. Below zero even
+ * disjoint boxes are above thresh.
+ */
+static void nms_overlap_graph(const nms_boxes *b, float thresh, int **offsets, int **neighbours)
+{
+    nms_overlap_fn overlap = nms_select();
+    int *hits = calloc(b->n, sizeof(int));
+    int *pairs = 0;
+    int i, j, n = 0, size = 0;
+    int *degree = calloc(b->n + 1, sizeof(int));
+    if(!hits || !degree) malloc_error();
+    for(i = 0; i < b->n; ++i){
+        int end = (thresh < 0) ? b->n : nms_sweep_end(b, i + 1, b->right[i]);
+        int m = overlap(b, i, i + 1, end, thresh, hits);
+        if(n + m > size){
+            while(n + m > size) size = size ? 2*size : 1024;
+            pairs = realloc(pairs, 2*(size_t)size*sizeof(int));
+            if(!pairs) malloc_error();
+        }
+        for(j = 0; j < m; ++j){
+            pairs[2*n] = i;
+            pairs[2*n + 1] = hits[j];
+            ++degree[i + 1];
+            ++degree[hits[j] + 1];
+            ++n;
+        }
+    }
+    for(i = 0; i < b->n; ++i) degree[i + 1] += degree[i];
+    *neighbours = calloc(2*(size_t)n + 1, sizeof(int));
+    if(!*neighbours) malloc_error();
+    memcpy(hits, degree, b->n*sizeof(int));
+    for(j = 0; j < n; ++j){
+        int p = pairs[2*j], q = pairs[2*j + 1];
+        (*neighbours)[hits[p]++] = q;
+        (*neighbours)[hits[q]++] = p;
+    }
+    *offsets = degree;
+    free(pairs);
+    free(hits);
+}
+
+/*
+ * Greedy nms on (box, class) candidates: per class, in descending
+ * probability, every candidate not yet suppressed zeroes the probability of
+ * the later ones of its class whose boxes overlap it by more than thresh.
+ * Ties in probability go to the earlier candidate. Which boxes overlap
+ * doesn't depend on the class, so the overlap graph is built once with a
+ * sweep over the boxes sorted by left edge; then the candidates are sorted
+ * once, grouped per class, and each is only checked against the neighbours
+ * of its box kept so far.
+ */
+void do_nms_candidates(box *boxes, int nboxes, nms_candidate *candidates, int n, int classes, float thresh)
+{
+    int i, k;
+    if(n == 0 || nboxes == 0) return;
+    nms_edge *edges = calloc(nboxes, sizeof(nms_edge));
+    int *place = calloc(nboxes, sizeof(int));
+    float *storage = calloc(5*(size_t)nboxes, sizeof(float));
+    if(!edges || !place || !storage) malloc_error();
+    for(i = 0; i < nboxes; ++i){
+        edges[i].left = boxes[i].x - boxes[i].w/2;
+        edges[i].box = i;
+    }
+    qsort(edges, nboxes, sizeof(nms_edge), nms_edge_comparator);
+
+    nms_boxes b = {0};
+    b.n = nboxes;
+    b.left = storage;
+    b.right = b.left + nboxes;
+    b.top = b.right + nboxes;
+    b.bottom = b.top + nboxes;
+    b.area = b.bottom + nboxes;
+    for(i = 0; i < nboxes; ++i){
+        box bb = boxes[edges[i].box];
+        place[edges[i].box] = i;
+        b.left[i] = bb.x - bb.w/2;
+        b.right[i] = bb.x + bb.w/2;
+        b.top[i] = bb.y - bb.h/2;
+        b.bottom[i] = bb.y + bb.h/2;
+        b.area[i] = bb.w*bb.h;
+    }
+    int *offsets, *neighbours;
+    nms_overlap_graph(&b, thresh, &offsets, &neighbours);
+
+    int *counts = calloc(classes + 1, sizeof(int));
+    nms_ref *sorted = calloc(n, sizeof(nms_ref));
+    nms_ref *grouped = calloc(n, sizeof(nms_ref));
+    if(!counts || !sorted || !grouped) malloc_error();
+    for(i = 0; i < n; ++i){
+        sorted[i].prob = candidates[i].prob;
+        sorted[i].box = place[candidates[i].box];
+        sorted[i].class_id = candidates[i].class_id;
+        sorted[i].index = i;
+        ++counts[candidates[i].class_id + 1];
+    }
+    nms_sort_refs(sorted, grouped, n);
+
+    // counts become group offsets, a stable pass keeps each group sorted
+    for(k = 0; k < classes; ++k) counts[k+1] += counts[k];
+    int *fill = calloc(classes, sizeof(int));
+    if(!fill) malloc_error();
+    memcpy(fill, counts, classes*sizeof(int));
+    for(i = 0; i < n; ++i) grouped[fill[sorted[i].class_id]++] = sorted[i];
+
+    // kept[box] is the last class the box survived in
+    int *kept = place;
+    for(i = 0; i < nboxes; ++i) kept[i] = -1;
+    for(k = 0; k < classes; ++k){
+        for(i = counts[k]; i < counts[k+1]; ++i){
+            int p = grouped[i].box, q;
+            if(grouped[i].prob == 0) continue;
+            for(q = offsets[p]; q < offsets[p+1]; ++q){
+                if(kept[neighbours[q]] == k) break;
+            }
+            if(q < offsets[p+1]) candidates[grouped[i].index].prob = 0;
+            else kept[p] = k;
+        }
+    }
+
+    free(fill);
+    free(sorted);
+    free(grouped);
+    free(counts);
+    free(offsets);
+    free(neighbours);
+    free(storage);
+    free(place);
+    free(edges);
+}
+
+/*
+ * Same result as do_nms_sort, through do_nms_candidates: every nonzero
+ * class probability of the boxes with nonzero objectness is a candidate.
+ * Unlike do_nms_sort the detections keep their order, and ties in
+ * probability go to the earlier detection.
+ */
+void do_nms_sweep(detection *dets, int total, int classes, float thresh)
+{
+    int i, k, n = 0, m = 0;
+    for(i = 0; i < total; ++i){
+        if(dets[i].objectness == 0) continue;
+        for(k = 0; k < classes; ++k) n += dets[i].prob[k] != 0;
+    }
+    if(n == 0) return;
+    box *boxes = calloc(total, sizeof(box));
+    int *ids = calloc(total, sizeof(int));
+    nms_candidate *candidates = calloc(n, sizeof(nms_candidate));
+    if(!boxes || !ids || !candidates) malloc_error();
+    n = 0;
+    for(i = 0; i < total; ++i){
+        int first = n;
+        if(dets[i].objectness == 0) continue;
+        for(k = 0; k < classes; ++k){
+            if(dets[i].prob[k] == 0) continue;
+            candidates[n].prob = dets[i].prob[k];
+            candidates[n].box = m;
+            candidates[n].class_id = k;
+            ++n;
+        }
+        if(n == first) continue;
+        boxes[m] = dets[i].bbox;
+        ids[m] = i;
+        ++m;
+    }
+    do_nms_candidates(boxes, m, candidates, n, classes, thresh);
+    for(i = 0; i < n; ++i){
+        if(candidates[i].prob == 0) dets[ids[candidates[i].box]].prob[candidates[i].class_id] = 0;
+    }
+    free(candidates);
+    free(ids);
+    free(boxes);
+}
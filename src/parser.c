@@ -940,6 +940,50 @@ list *read_cfg(const char *filename)
     return options;
 }
 
+/*
+ * Rewrite cfgfile to filename with the fields that in-place model surgery
+ * (batchnorm folding, pruning) can change taken from the loaded network.
+ */
+void save_network_cfg(network *net, const char *cfgfile, const char *filename)
+{
+    list *sections = read_cfg(cfgfile);
+    FILE *fp = fopen(filename, "w");
+    if(!fp) file_error(filename);
+    node *n = sections->front;
+    int i = -1;
+    while(n){
+        section *s = (section *)n->val;
+        LAYER_TYPE type = string_to_layer_type(s->type);
+        layer l = {0};
+        if(i >= 0 && i < net->n) l = net->layers[i];
+        int patch = (type == CONVOLUTIONAL || type == CONNECTED) && l.type == type;
+        int wrote_bn = 0;
+        fprintf(fp, "%s\n", s->type);
+        node *o = s->options->front;
+        while(o){
+            kvp *p = (kvp *)o->val;
+            if(patch && strcmp(p->key, "batch_normalize") == 0){
+                fprintf(fp, "%s=%d\n", p->key, l.batch_normalize);
+                wrote_bn = 1;
+            } else if(patch && type == CONVOLUTIONAL && strcmp(p->key, "filters") == 0){
+                fprintf(fp, "%s=%d\n", p->key, l.n);
+            } else if(patch && type == CONNECTED && strcmp(p->key, "output") == 0){
+                fprintf(fp, "%s=%d\n", p->key, l.outputs);
+            } else {
+                fprintf(fp, "%s=%s\n", p->key, p->val ? p->val : "");
+            }
+            o = o->next;
+        }
+        if(patch && !wrote_bn && l.batch_normalize) fprintf(fp, "batch_normalize=1\n");
+        fprintf(fp, "\n");
+        free_section(s);
+        n = n->next;
+        ++i;
+    }
+    free_list(sections);
+    fclose(fp);
+}
+
 void save_convolutional_weights_binary(layer l, FILE *fp)
 {
 #ifdef GPU
@@ -1122,6 +1166,7 @@ void load_connected_weights(layer l, FILE *fp, int transpose)
     if(transpose){
         transpose_matrix(l.weights, l.inputs, l.outputs);
     }
+    transform_connected_weights(l);
     //printf("Biases: %f mean %f variance\n", mean_array(l.biases, l.outputs), variance_array(l.biases, l.outputs));
     //printf("Weights: %f mean %f variance\n", mean_array(l.weights, l.outputs*l.inputs), variance_array(l.weights, l.outputs*l.inputs));
     if (l.batch_normalize && (!l.dontloadscales)){
@@ -1227,6 +1272,7 @@ void load_convolutional_weights(layer l, FILE *fp)
         transpose_matrix(l.weights, l.c*l.size*l.size, l.n);
     }
     //if (l.binary) binarize_weights(l.weights, l.n, l.c*l.size*l.size, l.weights);
+    transform_convolutional_weights(l);
 #ifdef GPU
     if(gpu_index >= 0){
         push_convolutional_layer(l);
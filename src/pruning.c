@@ -1,4 +1,6 @@
 #include "pruning.h"
+#include "convolutional_layer.h"
+#include "activations.h"
 #include <math.h>
 
 struct FilterInfo
@@ -78,6 +80,7 @@ void prune_network(network *net)
         }
 
         free(filter_info);
+        transform_convolutional_weights(l);
 
 #ifdef GPU
         // push modified weights to GPU
@@ -98,3 +101,271 @@ void prune_networks(network **nets, int n)
         prune_network(nets[i]);
     }
 }
+
+/*
+ * Compaction works on per-channel state of every layer output:
+ *   cst/val: the channel holds the constant val everywhere
+ *   rm:      the channel can be dropped without changing the network output
+ */
+struct ChannelInfo
+{
+    char *cst;
+    float *val;
+    char *rm;
+};
+
+static int layer_sources(network *net, int j, int *src, int *off)
+{
+    layer l = net->layers[j];
+    int k, o = 0;
+    if (l.type == ROUTE) {
+        for (k=0; k<l.n; ++k) {
+            src[k] = l.input_layers[k];
+            off[k] = o;
+            o += net->layers[src[k]].out_c;
+        }
+        return l.n;
+    }
+    if (j == 0)
+        return 0;
+    src[0] = j-1;
+    off[0] = 0;
+    if (l.type == SHORTCUT) {
+        src[1] = l.index;
+        off[1] = 0;
+        return 2;
+    }
+    return 1;
+}
+
+// room for the sources of any layer: a route's inputs or the two of a shortcut
+static int max_sources(network *net)
+{
+    int i, m = 2;
+    for (i=0; i<net->n; ++i) {
+        if (net->layers[i].type == ROUTE && net->layers[i].n > m)
+            m = net->layers[i].n;
+    }
+    return m;
+}
+
+static void find_constant_channels(network *net, struct ChannelInfo *info)
+{
+    int i, f, k, ch;
+    int *src = calloc(max_sources(net), sizeof(int));
+    int *off = calloc(max_sources(net), sizeof(int));
+
+    for (i=0; i<net->n; ++i) {
+        layer l = net->layers[i];
+        struct ChannelInfo *c = &info[i];
+        int ns = layer_sources(net, i, src, off);
+
+        if (l.type == CONVOLUTIONAL) {
+            int size = l.nweights/l.n;
+            for (f=0; f<l.n; ++f) {
+                int zero = 1;
+                for (k=0; k<size && zero; ++k) zero = (l.weights[f*size + k] == 0);
+                float x = l.biases[f];
+                if (l.batch_normalize && l.scales[f] == 0) {
+                    zero = 1;
+                } else if (l.batch_normalize) {
+                    x += l.scales[f]*(0 - l.rolling_mean[f])/(sqrt(l.rolling_variance[f]) + .000001f);
+                }
+                c->cst[f] = zero;
+                c->val[f] = activate(x, l.activation);
+            }
+        } else if (l.type == ROUTE) {
+            for (k=0; k<ns; ++k) {
+                struct ChannelInfo *s = &info[src[k]];
+                memcpy(c->cst + off[k], s->cst, net->layers[src[k]].out_c);
+                memcpy(c->val + off[k], s->val, net->layers[src[k]].out_c*sizeof(float));
+            }
+        } else if (l.type == SHORTCUT && l.w == l.out_w && l.h == l.out_h && l.c == l.out_c) {
+            struct ChannelInfo *a = &info[i-1];
+            struct ChannelInfo *b = &info[l.index];
+            for (ch=0; ch<l.out_c; ++ch) {
+                c->cst[ch] = a->cst[ch] && b->cst[ch];
+                c->val[ch] = activate(l.alpha*a->val[ch] + l.beta*b->val[ch], l.activation);
+            }
+        } else if ((l.type == MAXPOOL || l.type == UPSAMPLE) && i > 0) {
+            float scale = (l.type == UPSAMPLE) ? l.scale : 1;
+            for (ch=0; ch<l.out_c; ++ch) {
+                c->cst[ch] = info[i-1].cst[ch];
+                c->val[ch] = info[i-1].val[ch]*scale;
+            }
+        }
+        memcpy(c->rm, c->cst, l.out_c);
+    }
+    free(src);
+    free(off);
+}
+
+/*
+ * Can consumer j do without its input channel ch (holding constant v)?
+ * Convolutions fold a constant into their bias, which is exact unless zero
+ * padding would see it only partially.
+ */
+static int consumer_allows(network *net, struct ChannelInfo *info, int j, int ch, float v)
+{
+    layer l = net->layers[j];
+    switch (l.type) {
+        case CONVOLUTIONAL:
+            return l.groups == 1 && !l.binary && !l.xnor && (v == 0 || l.size == 1 || l.pad == 0);
+        case SHORTCUT:
+            return l.w == l.out_w && l.h == l.out_h && l.c == l.out_c && info[j].rm[ch];
+        case ROUTE:
+        case MAXPOOL:
+        case UPSAMPLE:
+            return info[j].rm[ch];
+        default:
+            return 0;
+    }
+}
+
+static int all_set(char *a, int n)
+{
+    int i;
+    for (i=0; i<n; ++i) {
+        if (!a[i])
+            return 0;
+    }
+    return n > 0;
+}
+
+static void find_removable_channels(network *net, struct ChannelInfo *info)
+{
+    int j, k, ch, changed = 1;
+    int *src = calloc(max_sources(net), sizeof(int));
+    int *off = calloc(max_sources(net), sizeof(int));
+
+    memset(info[net->n-1].rm, 0, net->layers[net->n-1].out_c);
+    // grouped filters are laid out per group, their outputs stay as they are
+    for (j=0; j<net->n; ++j) {
+        if (net->layers[j].type == CONVOLUTIONAL && net->layers[j].groups > 1)
+            memset(info[j].rm, 0, net->layers[j].out_c);
+    }
+    while (changed) {
+        changed = 0;
+        for (j=0; j<net->n; ++j) {
+            layer l = net->layers[j];
+            int ns = layer_sources(net, j, src, off);
+
+            // never empty a layer completely
+            if (all_set(info[j].rm, l.out_c)) {
+                info[j].rm[0] = 0;
+                changed = 1;
+            }
+            for (k=0; k<ns; ++k) {
+                struct ChannelInfo *s = &info[src[k]];
+                for (ch=0; ch<net->layers[src[k]].out_c; ++ch) {
+                    // a source channel goes only if this consumer can do without it
+                    if (s->rm[ch] && !consumer_allows(net, info, j, off[k] + ch, s->val[ch])) {
+                        s->rm[ch] = 0;
+                        changed = 1;
+                    }
+                    // and layers passing channels through drop only what all their sources drop
+                    if (l.type != CONVOLUTIONAL && off[k] + ch < l.out_c && info[j].rm[off[k] + ch] && !s->rm[ch]) {
+                        info[j].rm[off[k] + ch] = 0;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+    free(src);
+    free(off);
+}
+
+static int compact_convolutional_layer(layer *l, struct ChannelInfo *in, struct ChannelInfo *out)
+{
+    int size = l->size*l->size;
+    int f, ch, k, n = 0, c = 0;
+
+    // neither inputs nor outputs of a grouped convolution are ever removed
+    if (l->groups > 1)
+        return 0;
+
+    // fold constant input channels into the bias (or the batchnorm mean)
+    for (f=0; f<l->n; ++f) {
+        float delta = 0;
+        for (ch=0; in && ch<l->c; ++ch) {
+            if (!in->rm[ch] || in->val[ch] == 0)
+                continue;
+            for (k=0; k<size; ++k) delta += in->val[ch]*l->weights[(f*l->c + ch)*size + k];
+        }
+        if (l->batch_normalize) {
+            l->rolling_mean[f] -= delta;
+        } else {
+            l->biases[f] += delta;
+        }
+    }
+
+    for (f=0; f<l->n; ++f) {
+        if (out->rm[f])
+            continue;
+        c = 0;
+        for (ch=0; ch<l->c; ++ch) {
+            if (in && in->rm[ch])
+                continue;
+            memmove(l->weights + (n*l->c + c)*size, l->weights + (f*l->c + ch)*size, size*sizeof(float));
+            ++c;
+        }
+        l->biases[n] = l->biases[f];
+        if (l->batch_normalize) {
+            l->scales[n] = l->scales[f];
+            l->rolling_mean[n] = l->rolling_mean[f];
+            l->rolling_variance[n] = l->rolling_variance[f];
+        }
+        ++n;
+    }
+    // repack rows that were written with the old channel stride
+    for (f=0; f<n; ++f) {
+        memmove(l->weights + f*c*size, l->weights + (f*l->c)*size, c*size*sizeof(float));
+    }
+
+    int removed = l->n - n;
+    l->n = n;
+    l->c = c;
+    l->out_c = n;
+    l->nweights = n*c*size;
+    l->outputs = l->out_h*l->out_w*l->out_c;
+    l->inputs = l->h*l->w*l->c;
+    return removed;
+}
+
+int compact_network(network *net)
+{
+    struct ChannelInfo *info = calloc(net->n, sizeof(struct ChannelInfo));
+    int i, removed = 0;
+
+    for (i=0; i<net->n; ++i) {
+        int n = net->layers[i].out_c;
+        info[i].cst = calloc(n, 1);
+        info[i].val = calloc(n, sizeof(float));
+        info[i].rm = calloc(n, 1);
+    }
+#ifdef GPU
+    if (net->gpu_index >= 0) {
+        for (i=0; i<net->n; ++i) {
+            if (net->layers[i].type == CONVOLUTIONAL) pull_convolutional_layer(net->layers[i]);
+        }
+    }
+#endif
+    find_constant_channels(net, info);
+    find_removable_channels(net, info);
+
+    for (i=0; i<net->n; ++i) {
+        layer *l = &net->layers[i];
+        if (l->type != CONVOLUTIONAL)
+            continue;
+        removed += compact_convolutional_layer(l, i > 0 ? &info[i-1] : 0, &info[i]);
+    }
+
+    for (i=0; i<net->n; ++i) {
+        free(info[i].cst);
+        free(info[i].val);
+        free(info[i].rm);
+    }
+    free(info);
+    return removed;
+}
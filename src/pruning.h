@@ -18,4 +18,17 @@ void prune_network(network *net);
  */
 void prune_networks(network **nets, int n);
 
+/*
+ *  Physically remove pruned filters from a network. Filters whose output is constant (all zero
+ *  weights or a zero batchnorm scale) are dropped together with the matching input channels of
+ *  every consumer, following route, shortcut, maxpool and upsample layers. Non-zero constants are
+ *  folded into the bias of consuming 1x1 (or unpadded) convolutions, so the network output does
+ *  not change. Only the layer sizes and weights needed by save_network_cfg/save_weights are
+ *  updated: reload the saved files before running the network.
+ *  net:        Network instance
+ *
+ *  returns the number of removed filters
+ */
+int compact_network(network *net);
+
 #endif /* PRUNING_H */
@@ -0,0 +1,378 @@
+#include "quantize.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Packed layouts, with K padded to a multiple of 4:
+ *   weights: panels of mr rows, [K/4][mr][4] int8 per panel
+ *   inputs:  panels of 8 columns, [K/4][8][4] uint8 per panel
+ * so one 32 byte load of B and a 4 byte broadcast of A feed 8 dot products.
+ */
+#define INT8_NR 8
+#define INT8_MAX_MR 8
+// output columns gathered and quantized per task
+#define INT8_COL_BLOCK 64
+
+typedef void (*int8_kernel_fn)(int kg, const signed char *a, const unsigned char *b, int *c);
+
+typedef struct{
+    const char *name;
+    int mr;
+    int8_kernel_fn kernel;
+} int8_kernel;
+
+static void int8_kernel_generic_4x8(int kg, const signed char *a, const unsigned char *b, int *c)
+{
+    int acc[4][INT8_NR] = {{0}};
+    int g, i, j, p;
+    for(g = 0; g < kg; ++g){
+        for(i = 0; i < 4; ++i){
+            for(j = 0; j < INT8_NR; ++j){
+                for(p = 0; p < 4; ++p){
+                    acc[i][j] += a[i*4 + p]*b[j*4 + p];
+                }
+            }
+        }
+        a += 4*4;
+        b += INT8_NR*4;
+    }
+    memcpy(c, acc, sizeof(acc));
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INT8_X86
+#include <immintrin.h>
+
+static inline int int8_load4(const signed char *a)
+{
+    int v;
+    memcpy(&v, a, sizeof(v));
+    return v;
+}
+
+/*
+ * pmaddubsw would saturate its int16 pair sums for full range weights, so
+ * widen both operands to int16 and use pmaddwd instead.
+ */
+__attribute__((target("avx2")))
+static void int8_kernel_avx2_4x8(int kg, const signed char *a, const unsigned char *b, int *c)
+{
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    int g;
+    for(g = 0; g < kg; ++g){
+        __m256i bv = _mm256_loadu_si256((const __m256i *)b);
+        __m256i b0 = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bv));
+        __m256i b1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bv, 1));
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_set1_epi32(int8_load4(a)));
+        __m256i a1 = _mm256_cvtepi8_epi16(_mm_set1_epi32(int8_load4(a + 4)));
+        __m256i a2 = _mm256_cvtepi8_epi16(_mm_set1_epi32(int8_load4(a + 8)));
+        __m256i a3 = _mm256_cvtepi8_epi16(_mm_set1_epi32(int8_load4(a + 12)));
+        c00 = _mm256_add_epi32(c00, _mm256_madd_epi16(b0, a0));
+        c01 = _mm256_add_epi32(c01, _mm256_madd_epi16(b1, a0));
+        c10 = _mm256_add_epi32(c10, _mm256_madd_epi16(b0, a1));
+        c11 = _mm256_add_epi32(c11, _mm256_madd_epi16(b1, a1));
+        c20 = _mm256_add_epi32(c20, _mm256_madd_epi16(b0, a2));
+        c21 = _mm256_add_epi32(c21, _mm256_madd_epi16(b1, a2));
+        c30 = _mm256_add_epi32(c30, _mm256_madd_epi16(b0, a3));
+        c31 = _mm256_add_epi32(c31, _mm256_madd_epi16(b1, a3));
+        a += 16;
+        b += 32;
+    }
+    // each accumulator holds two partial sums per column
+    _mm256_storeu_si256((__m256i *)c,        _mm256_permute4x64_epi64(_mm256_hadd_epi32(c00, c01), 0xD8));
+    _mm256_storeu_si256((__m256i *)(c + 8),  _mm256_permute4x64_epi64(_mm256_hadd_epi32(c10, c11), 0xD8));
+    _mm256_storeu_si256((__m256i *)(c + 16), _mm256_permute4x64_epi64(_mm256_hadd_epi32(c20, c21), 0xD8));
+    _mm256_storeu_si256((__m256i *)(c + 24), _mm256_permute4x64_epi64(_mm256_hadd_epi32(c30, c31), 0xD8));
+}
+
+__attribute__((target("avx2,avx512vl,avx512vnni")))
+static void int8_kernel_vnni_8x8(int kg, const signed char *a, const unsigned char *b, int *c)
+{
+    __m256i c0 = _mm256_setzero_si256(), c1 = _mm256_setzero_si256();
+    __m256i c2 = _mm256_setzero_si256(), c3 = _mm256_setzero_si256();
+    __m256i c4 = _mm256_setzero_si256(), c5 = _mm256_setzero_si256();
+    __m256i c6 = _mm256_setzero_si256(), c7 = _mm256_setzero_si256();
+    int g;
+    for(g = 0; g < kg; ++g){
+        __m256i bv = _mm256_loadu_si256((const __m256i *)b);
+        c0 = _mm256_dpbusd_epi32(c0, bv, _mm256_set1_epi32(int8_load4(a)));
+        c1 = _mm256_dpbusd_epi32(c1, bv, _mm256_set1_epi32(int8_load4(a + 4)));
+        c2 = _mm256_dpbusd_epi32(c2, bv, _mm256_set1_epi32(int8_load4(a + 8)));
+        c3 = _mm256_dpbusd_epi32(c3, bv, _mm256_set1_epi32(int8_load4(a + 12)));
+        c4 = _mm256_dpbusd_epi32(c4, bv, _mm256_set1_epi32(int8_load4(a + 16)));
+        c5 = _mm256_dpbusd_epi32(c5, bv, _mm256_set1_epi32(int8_load4(a + 20)));
+        c6 = _mm256_dpbusd_epi32(c6, bv, _mm256_set1_epi32(int8_load4(a + 24)));
+        c7 = _mm256_dpbusd_epi32(c7, bv, _mm256_set1_epi32(int8_load4(a + 28)));
+        a += 32;
+        b += 32;
+    }
+    _mm256_storeu_si256((__m256i *)c,        c0);
+    _mm256_storeu_si256((__m256i *)(c + 8),  c1);
+    _mm256_storeu_si256((__m256i *)(c + 16), c2);
+    _mm256_storeu_si256((__m256i *)(c + 24), c3);
+    _mm256_storeu_si256((__m256i *)(c + 32), c4);
+    _mm256_storeu_si256((__m256i *)(c + 40), c5);
+    _mm256_storeu_si256((__m256i *)(c + 48), c6);
+    _mm256_storeu_si256((__m256i *)(c + 56), c7);
+}
+#endif
+
+static int8_kernel int8_kernel_selected;
+static pthread_once_t int8_kernel_once = PTHREAD_ONCE_INIT;
+
+static void int8_select_kernel_init()
+{
+    int8_kernel k = {0};
+    k.name = "generic";
+    k.mr = 4;
+    k.kernel = int8_kernel_generic_4x8;
+#ifdef INT8_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")){
+        k.name = "vnni";
+        k.mr = 8;
+        k.kernel = int8_kernel_vnni_8x8;
+    } else if(__builtin_cpu_supports("avx2")){
+        k.name = "avx2";
+        k.mr = 4;
+        k.kernel = int8_kernel_avx2_4x8;
+    }
+#endif
+    int8_kernel_selected = k;
+}
+
+static int8_kernel int8_select_kernel()
+{
+    pthread_once(&int8_kernel_once, int8_select_kernel_init);
+    return int8_kernel_selected;
+}
+
+int quantize_supported(layer l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return 0;
+#endif
+    return l.type == CONVOLUTIONAL && l.c >= QUANT_MIN_CHANNELS && l.groups == 1 && !l.binary && !l.xnor && !l.batch_normalize;
+}
+
+/*
+ * Quantize l->weights with the given per-filter scales and pack them for the
+ * selected kernel. The network must already have its batchnorm folded.
+ */
+void quantize_convolutional_layer(layer *l, float input_scale, float *weight_scales)
+{
+    int8_kernel k = int8_select_kernel();
+    int K = l->c*l->size*l->size;
+    int kg = (K + 3)/4;
+    int mpad = ((l->n + k.mr - 1)/k.mr)*k.mr;
+    int i, j;
+
+    free(l->quant_weights);
+    free(l->quant_weight_scales);
+    free(l->quant_offsets);
+    l->quant_input_scale = input_scale;
+    l->quant_weights = calloc((size_t)mpad*kg*4, sizeof(signed char));
+    l->quant_weight_scales = calloc(l->n, sizeof(float));
+    l->quant_offsets = calloc(l->n, sizeof(int));
+    if(!l->quant_weights || !l->quant_weight_scales || !l->quant_offsets) malloc_error();
+
+    for(i = 0; i < l->n; ++i){
+        float scale = weight_scales[i];
+        float *w = l->weights + (size_t)i*K;
+        signed char *panel = l->quant_weights + (size_t)(i/k.mr)*k.mr*kg*4;
+        int r = i % k.mr;
+        int sum = 0;
+        l->quant_weight_scales[i] = scale;
+        for(j = 0; j < K; ++j){
+            int q = (scale > 0) ? (int)lrintf(w[j]/scale) : 0;
+            if(q > 127) q = 127;
+            if(q < -127) q = -127;
+            panel[(j/4)*k.mr*4 + r*4 + j%4] = q;
+            sum += q;
+        }
+        l->quant_offsets[i] = QUANT_ZERO_POINT*sum;
+    }
+}
+
+typedef struct{
+    int8_kernel k;
+    const layer *l;
+    float *im;
+    float inv_scale;
+    int N, K, kg;
+    const gemm_epilogue *ep;
+    float *out;
+} int8_args;
+
+static inline unsigned char int8_quantize(float x, float inv_scale)
+{
+    int q = (int)lrintf(x*inv_scale) + QUANT_ZERO_POINT;
+    if(q < 0) q = 0;
+    if(q > 255) q = 255;
+    return q;
+}
+
+static void int8_pack_input(const int8_args *a, int n0, int nc, unsigned char *pb)
+{
+    const layer *l = a->l;
+    int ks = l->size;
+    int colx[INT8_COL_BLOCK], coly[INT8_COL_BLOCK];
+    int kk, s;
+    int npad = (nc + INT8_NR - 1)/INT8_NR*INT8_NR;
+    memset(pb, QUANT_ZERO_POINT, (size_t)a->kg*4*npad);
+    for(s = 0; s < nc; ++s){
+        colx[s] = (n0 + s) % l->out_w * l->stride - l->pad;
+        coly[s] = (n0 + s) / l->out_w * l->stride - l->pad;
+    }
+    for(kk = 0; kk < a->K; ++kk){
+        int kx = kk % ks;
+        int ky = kk / ks % ks;
+        const float *im = a->im + (size_t)(kk / ks / ks)*l->h*l->w;
+        unsigned char *dst = pb + (kk/4)*INT8_NR*4 + kk%4;
+        for(s = 0; s < nc; ++s){
+            int x = colx[s] + kx;
+            int y = coly[s] + ky;
+            if(x >= 0 && x < l->w && y >= 0 && y < l->h){
+                dst[(size_t)(s/INT8_NR)*a->kg*INT8_NR*4 + (s%INT8_NR)*4] = int8_quantize(im[y*l->w + x], a->inv_scale);
+            }
+        }
+    }
+}
+
+static void int8_columns(void *ptr, int begin, int end)
+{
+    int8_args *a = ptr;
+    const layer *l = a->l;
+    int8_kernel k = a->k;
+    int t, i, j, r, s;
+    int acc[INT8_MAX_MR*INT8_NR];
+    float row[INT8_NR];
+    unsigned char *pb = calloc((size_t)a->kg*INT8_COL_BLOCK*4, 1);
+    if(!pb) malloc_error();
+    for(t = begin; t < end; ++t){
+        int n0 = t*INT8_COL_BLOCK;
+        int nc = (a->N - n0 < INT8_COL_BLOCK) ? a->N - n0 : INT8_COL_BLOCK;
+        int8_pack_input(a, n0, nc, pb);
+        for(i = 0; i < l->n; i += k.mr){
+            int rows = (l->n - i < k.mr) ? l->n - i : k.mr;
+            const signed char *pa = l->quant_weights + (size_t)i*a->kg*4;
+            for(j = 0; j < nc; j += INT8_NR){
+                int cols = (nc - j < INT8_NR) ? nc - j : INT8_NR;
+                k.kernel(a->kg, pa, pb + (size_t)j*a->kg*4, acc);
+                for(r = 0; r < rows; ++r){
+                    int f = i + r;
+                    float scale = l->quant_input_scale*l->quant_weight_scales[f];
+                    float *out = a->out + (size_t)f*a->N + n0 + j;
+                    for(s = 0; s < cols; ++s){
+                        row[s] = (acc[r*INT8_NR + s] - l->quant_offsets[f])*scale;
+                    }
+                    memcpy(out, row, cols*sizeof(float));
+                    if(a->ep) gemm_epilogue_run(a->ep, f, n0 + j, out, cols);
+                }
+            }
+        }
+    }
+    free(pb);
+}
+
+/* one image of the batch: out = epilogue(conv(im)) */
+void convolve_int8(layer l, float *im, const gemm_epilogue *ep, float *out)
+{
+    int8_args a = {0};
+    a.k = int8_select_kernel();
+    a.l = &l;
+    a.im = im;
+    a.inv_scale = 1./l.quant_input_scale;
+    a.N = l.out_h*l.out_w;
+    a.K = l.c*l.size*l.size;
+    a.kg = (a.K + 3)/4;
+    a.ep = ep;
+    a.out = out;
+    parallel_for((a.N + INT8_COL_BLOCK - 1)/INT8_COL_BLOCK, 1, int8_columns, &a);
+}
+
+/*
+ * Calibration: track the largest input magnitude each conv layer sees.
+ * input is what was passed to network_predict, ranges has net->n entries
+ * and starts zeroed.
+ */
+void quantization_observe(network *net, float *input, float *ranges)
+{
+    int i, j;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type != CONVOLUTIONAL) continue;
+        float *x = (i == 0) ? input : net->layers[i-1].output;
+        int n = l.inputs*l.batch;
+        for(j = 0; j < n; ++j){
+            float v = fabsf(x[j]);
+            if(v > ranges[i]) ranges[i] = v;
+        }
+    }
+}
+
+/*
+ * One line per quantized layer:
+ *   <layer> <input scale> <filters> <weight scale>...
+ * Layers can be dropped from the file to keep them in float.
+ */
+void save_quantization(network *net, float *ranges, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    int i, f, j;
+    if(!fp) file_error(filename);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!quantize_supported(l) || ranges[i] <= 0) continue;
+        int K = l.c*l.size*l.size;
+        fprintf(fp, "%d %g %d", i, ranges[i]/127., l.n);
+        for(f = 0; f < l.n; ++f){
+            float max = 0;
+            for(j = 0; j < K; ++j){
+                float v = fabsf(l.weights[f*K + j]);
+                if(v > max) max = v;
+            }
+            fprintf(fp, " %g", max/127.);
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+/*
+ * Quantize the layers listed in a save_quantization file. Returns 0 and
+ * leaves the network in float when it runs NHWC, which has no int8 path.
+ */
+int load_quantization(network *net, const char *filename)
+{
+    FILE *fp;
+    int index, n, f, count = 0;
+    float input_scale;
+    if(net->nhwc) return 0;
+    fp = fopen(filename, "r");
+    if(!fp) file_error(filename);
+    fold_batchnorm_network(net);
+    while(fscanf(fp, "%d %f %d", &index, &input_scale, &n) == 3){
+        float *scales = calloc(n, sizeof(float));
+        for(f = 0; f < n; ++f){
+            if(fscanf(fp, "%f", scales + f) != 1) error("Truncated quantization file");
+        }
+        if(index >= 0 && index < net->n && net->layers[index].n == n && quantize_supported(net->layers[index])){
+            quantize_convolutional_layer(net->layers + index, input_scale, scales);
+            ++count;
+        } else {
+            fprintf(stderr, "Skipping quantization of layer %d\n", index);
+        }
+        free(scales);
+    }
+    fclose(fp);
+    fprintf(stderr, "Quantized %d layers to int8 (%s kernel)\n", count, int8_select_kernel().name);
+    return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+#include "darknet.h"
+#include "gemm.h"
+
+/*
+ * Int8 inference for convolutional layers.
+ * Inputs are quantized to uint8 with a zero point of 128 and a per-layer
+ * scale, weights to int8 with a per-output-channel scale. Products are
+ * accumulated in int32 and turned back into floats in the GEMM epilogue.
+ */
+#define QUANT_ZERO_POINT 128
+// thin input layers (the rgb stem) cost more to quantize than they save
+#define QUANT_MIN_CHANNELS 16
+
+int quantize_supported(layer l);
+void quantize_convolutional_layer(layer *l, float input_scale, float *weight_scales);
+void convolve_int8(layer l, float *im, const gemm_epilogue *ep, float *out);
+
+#endif
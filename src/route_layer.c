@@ -3,6 +3,7 @@
 #include "blas.h"
 
 #include <stdio.h>
+#include <string.h>
 
 route_layer make_route_layer(int batch, int n, int *input_layers, int *input_sizes)
 {
@@ -71,16 +72,39 @@ void resize_route_layer(route_layer *l, network *net)
     
 }
 
+/* interleaved layout: concatenate the channels of each pixel */
+static void forward_route_layer_nhwc(const route_layer l, network net)
+{
+    int i, p;
+    int pixels = l.out_w*l.out_h*l.batch;
+    int offset = 0;
+    for(i = 0; i < l.n; ++i){
+        int index = l.input_layers[i];
+        float *input = net.layers[index].output;
+        int c = net.layers[index].out_c;
+        for(p = 0; p < pixels; ++p){
+            memcpy(l.output + (size_t)p*l.out_c + offset, input + (size_t)p*c, c*sizeof(float));
+        }
+        offset += c;
+    }
+}
+
 void forward_route_layer(const route_layer l, network net)
 {
     int i, j;
     int offset = 0;
+    if(net.nhwc){
+        forward_route_layer_nhwc(l, net);
+        return;
+    }
     for(i = 0; i < l.n; ++i){
         int index = l.input_layers[i];
         float *input = net.layers[index].output;
         int input_size = l.input_sizes[i];
         for(j = 0; j < l.batch; ++j){
-            copy_cpu(input_size, input + j*input_size, 1, l.output + offset + j*l.outputs, 1);
+            float *out = l.output + offset + j*l.outputs;
+            // inputs planned by set_network_route_views are already in place
+            if(input + j*input_size != out) copy_cpu(input_size, input + j*input_size, 1, out, 1);
         }
         offset += input_size;
     }
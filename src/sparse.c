@@ -0,0 +1,216 @@
+#include "sparse.h"
+#include "im2col.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <string.h>
+
+// output columns per task: one row of the block stays in a couple of cache lines
+#define SPARSE_COL_BLOCK 64
+
+sparse_matrix *make_sparse_matrix(int rows, int cols)
+{
+    sparse_matrix *s = calloc(1, sizeof(sparse_matrix));
+    if(!s) malloc_error();
+    s->rows = rows;
+    s->cols = cols;
+    s->row_ptr = calloc(rows + 1, sizeof(int));
+    return s;
+}
+
+void free_sparse_matrix(sparse_matrix *s)
+{
+    if(!s) return;
+    free(s->row_ptr);
+    free(s->col_idx);
+    free(s->vals);
+    free(s);
+}
+
+/*
+ * Rebuild from the dense rows x cols matrix a, or deactivate when it is
+ * too dense. The value arrays are dropped while inactive.
+ */
+void sparse_matrix_update(sparse_matrix *s, float *a)
+{
+    size_t size = (size_t)s->rows*s->cols;
+    size_t i;
+    int nnz = 0, r, c;
+    for(i = 0; i < size; ++i) nnz += (a[i] != 0);
+    s->active = size > 0 && nnz <= SPARSE_MAX_DENSITY*size;
+    if(!s->active){
+        free(s->col_idx);
+        free(s->vals);
+        s->col_idx = 0;
+        s->vals = 0;
+        s->nnz = s->capacity = 0;
+        return;
+    }
+    if(nnz > s->capacity || !s->vals){
+        s->capacity = nnz > 0 ? nnz : 1;
+        s->col_idx = realloc(s->col_idx, s->capacity*sizeof(int));
+        s->vals = realloc(s->vals, s->capacity*sizeof(float));
+        if(!s->col_idx || !s->vals) malloc_error();
+    }
+    s->nnz = 0;
+    for(r = 0; r < s->rows; ++r){
+        s->row_ptr[r] = s->nnz;
+        for(c = 0; c < s->cols; ++c){
+            float v = a[(size_t)r*s->cols + c];
+            if(v == 0) continue;
+            s->col_idx[s->nnz] = c;
+            s->vals[s->nnz] = v;
+            ++s->nnz;
+        }
+    }
+    s->row_ptr[s->rows] = s->nnz;
+}
+
+typedef struct{
+    const sparse_matrix *a;
+    float *im;
+    int channels, height, width, ksize, stride, pad;
+    int n;
+    float *c;
+    const gemm_epilogue *epilogue;
+} sparse_conv_args;
+
+typedef void (*sparse_block_fn)(const sparse_matrix *a, const float *b, int ldb, float *c, int ldc, int nc);
+
+/* c[r][0..nc) += sum over row r of a of v * b[col][0..nc) */
+static inline __attribute__((always_inline)) void sparse_block_body(const sparse_matrix *a, const float *b, int ldb, float *c, int ldc, int nc)
+{
+    float acc[SPARSE_COL_BLOCK];
+    int r, p, j;
+    for(r = 0; r < a->rows; ++r){
+        memset(acc, 0, sizeof(acc));
+        for(p = a->row_ptr[r]; p < a->row_ptr[r + 1]; ++p){
+            const float *row = b + (size_t)a->col_idx[p]*ldb;
+            float v = a->vals[p];
+            if(nc == SPARSE_COL_BLOCK){
+                for(j = 0; j < SPARSE_COL_BLOCK; ++j) acc[j] += v*row[j];
+            } else {
+                for(j = 0; j < nc; ++j) acc[j] += v*row[j];
+            }
+        }
+        for(j = 0; j < nc; ++j) c[(size_t)r*ldc + j] += acc[j];
+    }
+}
+
+static void sparse_block_generic(const sparse_matrix *a, const float *b, int ldb, float *c, int ldc, int nc)
+{
+    sparse_block_body(a, b, ldb, c, ldc, nc);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPARSE_X86
+#include <immintrin.h>
+
+/* full blocks keep the 64 accumulators of a row in eight registers */
+__attribute__((target("avx2,fma")))
+static void sparse_block_avx2(const sparse_matrix *a, const float *b, int ldb, float *c, int ldc, int nc)
+{
+    int r, p, j;
+    if(nc != SPARSE_COL_BLOCK){
+        sparse_block_body(a, b, ldb, c, ldc, nc);
+        return;
+    }
+    for(r = 0; r < a->rows; ++r){
+        __m256 acc[8];
+        float *cr = c + (size_t)r*ldc;
+        for(j = 0; j < 8; ++j) acc[j] = _mm256_loadu_ps(cr + 8*j);
+        for(p = a->row_ptr[r]; p < a->row_ptr[r + 1]; ++p){
+            const float *row = b + (size_t)a->col_idx[p]*ldb;
+            __m256 v = _mm256_set1_ps(a->vals[p]);
+            for(j = 0; j < 8; ++j) acc[j] = _mm256_fmadd_ps(v, _mm256_loadu_ps(row + 8*j), acc[j]);
+        }
+        for(j = 0; j < 8; ++j) _mm256_storeu_ps(cr + 8*j, acc[j]);
+    }
+}
+#endif
+
+static sparse_block_fn sparse_selected;
+static pthread_once_t sparse_once = PTHREAD_ONCE_INIT;
+
+static void sparse_select_init()
+{
+#ifdef SPARSE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        sparse_selected = sparse_block_avx2;
+        return;
+    }
+#endif
+    sparse_selected = sparse_block_generic;
+}
+
+static sparse_block_fn sparse_select()
+{
+    pthread_once(&sparse_once, sparse_select_init);
+    return sparse_selected;
+}
+
+static void sparse_conv_blocks(void *ptr, int begin, int end)
+{
+    sparse_conv_args *g = ptr;
+    sparse_block_fn fn = sparse_select();
+    int direct = g->ksize == 1 && g->stride == 1 && g->pad == 0;
+    float *cols = direct ? 0 : calloc((size_t)g->a->cols*SPARSE_COL_BLOCK, sizeof(float));
+    int t, r;
+    if(!direct && !cols) malloc_error();
+    for(t = begin; t < end; ++t){
+        int n0 = t*SPARSE_COL_BLOCK;
+        int nc = (g->n - n0 < SPARSE_COL_BLOCK) ? g->n - n0 : SPARSE_COL_BLOCK;
+        if(direct){
+            fn(g->a, g->im + n0, g->n, g->c + n0, g->n, nc);
+        } else {
+            im2col_cols_cpu(g->im, g->channels, g->height, g->width, g->ksize, g->stride, g->pad, n0, nc, cols);
+            fn(g->a, cols, nc, g->c + n0, g->n, nc);
+        }
+        if(g->epilogue){
+            for(r = 0; r < g->a->rows; ++r){
+                gemm_epilogue_run(g->epilogue, r, n0, g->c + (size_t)r*g->n + n0, nc);
+            }
+        }
+    }
+    free(cols);
+}
+
+/* c += a * im2col(im), one block of output columns per task */
+void sparse_conv_cpu(const sparse_matrix *a, float *im, int channels, int height, int width,
+        int ksize, int stride, int pad, float *c, const gemm_epilogue *epilogue)
+{
+    int out_h = (height + 2*pad - ksize)/stride + 1;
+    int out_w = (width + 2*pad - ksize)/stride + 1;
+    sparse_conv_args g = {a, im, channels, height, width, ksize, stride, pad, out_h*out_w, c, epilogue};
+    parallel_for((g.n + SPARSE_COL_BLOCK - 1)/SPARSE_COL_BLOCK, 1, sparse_conv_blocks, &g);
+}
+
+typedef struct{
+    const sparse_matrix *a;
+    float *x;
+    int batch;
+    float *y;
+} sparse_gemv_args;
+
+static void sparse_gemv_rows(void *ptr, int begin, int end)
+{
+    sparse_gemv_args *g = ptr;
+    const sparse_matrix *a = g->a;
+    int b, r, p;
+    for(b = 0; b < g->batch; ++b){
+        const float *x = g->x + (size_t)b*a->cols;
+        float *y = g->y + (size_t)b*a->rows;
+        for(r = begin; r < end; ++r){
+            float sum = 0;
+            for(p = a->row_ptr[r]; p < a->row_ptr[r + 1]; ++p) sum += a->vals[p]*x[a->col_idx[p]];
+            y[r] += sum;
+        }
+    }
+}
+
+/* y[b] += a * x[b] for each of the batch input rows */
+void sparse_gemv_cpu(const sparse_matrix *a, float *x, int batch, float *y)
+{
+    sparse_gemv_args g = {a, x, batch, y};
+    parallel_for(a->rows, 64, sparse_gemv_rows, &g);
+}
@@ -0,0 +1,30 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+#include "darknet.h"
+#include "gemm.h"
+
+/*
+ * CSR copy of a layer's weight matrix, rebuilt whenever the weights are
+ * transformed. It is only active while the measured density is low enough
+ * for sparse x dense products to beat the dense kernels.
+ */
+typedef struct sparse_matrix{
+    int rows, cols;
+    int active;
+    int nnz, capacity;
+    int *row_ptr;
+    int *col_idx;
+    float *vals;
+} sparse_matrix;
+
+// above this fraction of nonzeros the dense and winograd kernels are faster
+#define SPARSE_MAX_DENSITY .2
+
+sparse_matrix *make_sparse_matrix(int rows, int cols);
+void free_sparse_matrix(sparse_matrix *s);
+void sparse_matrix_update(sparse_matrix *s, float *a);
+void sparse_conv_cpu(const sparse_matrix *a, float *im, int channels, int height, int width,
+        int ksize, int stride, int pad, float *c, const gemm_epilogue *epilogue);
+void sparse_gemv_cpu(const sparse_matrix *a, float *x, int batch, float *y);
+
+#endif
@@ -0,0 +1,126 @@
+#include "thread_pool.h"
+#include "utils.h"
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_t *workers;
+    int nworkers;
+    int quit;
+    unsigned int generation;
+    int active;
+
+    parallel_fn fn;
+    void *args;
+    int n;
+    int chunk;
+    int nchunks;
+    int next;
+} thread_pool;
+
+static thread_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static __thread int in_parallel = 0;
+
+static void run_chunks()
+{
+    int i;
+    in_parallel = 1;
+    while((i = __sync_fetch_and_add(&pool.next, 1)) < pool.nchunks){
+        int begin = i*pool.chunk;
+        int end = (begin + pool.chunk < pool.n) ? begin + pool.chunk : pool.n;
+        pool.fn(pool.args, begin, end);
+    }
+    in_parallel = 0;
+}
+
+static void *pool_worker(void *ptr)
+{
+    unsigned int seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while(1){
+        while(!pool.quit && pool.generation == seen){
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if(pool.quit) break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_chunks();
+
+        pthread_mutex_lock(&pool.lock);
+        if(--pool.active == 0) pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+void set_cpu_threads(int n)
+{
+    int i;
+    if(n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1) n = 1;
+    pthread_mutex_lock(&pool_busy);
+    if(n - 1 != pool.nworkers){
+        pthread_mutex_lock(&pool.lock);
+        pool.quit = 1;
+        pthread_cond_broadcast(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+        for(i = 0; i < pool.nworkers; ++i){
+            pthread_join(pool.workers[i], 0);
+        }
+        free(pool.workers);
+        pool.workers = 0;
+        pool.quit = 0;
+        pool.generation = 0;
+
+        pool.nworkers = n - 1;
+        if(pool.nworkers){
+            pool.workers = calloc(pool.nworkers, sizeof(pthread_t));
+            for(i = 0; i < pool.nworkers; ++i){
+                if(pthread_create(pool.workers + i, 0, pool_worker, 0)) error("Thread creation failed");
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool_busy);
+}
+
+int get_cpu_threads()
+{
+    return pool.nworkers + 1;
+}
+
+void parallel_for(int n, int grain, parallel_fn fn, void *args)
+{
+    if(n <= 0) return;
+    if(grain < 1) grain = 1;
+    if(!pool.nworkers || n < 2*grain || in_parallel || pthread_mutex_trylock(&pool_busy)){
+        fn(args, 0, n);
+        return;
+    }
+    int threads = pool.nworkers + 1;
+    int chunk = (n + 4*threads - 1)/(4*threads);
+    if(chunk < grain) chunk = grain;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.args = args;
+    pool.n = n;
+    pool.chunk = chunk;
+    pool.nchunks = (n + chunk - 1)/chunk;
+    pool.next = 0;
+    pool.active = pool.nworkers;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_chunks();
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.active) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool_busy);
+}
@@ -0,0 +1,23 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include "darknet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*parallel_fn)(void *args, int begin, int end);
+
+/*
+ * Run fn over [0, n) on the CPU worker pool. The range is cut into chunks
+ * of at least grain items which the workers and the calling thread pick up
+ * dynamically. Falls back to a plain call on the calling thread when the
+ * pool has a single thread, is already busy or n is smaller than grain.
+ */
+void parallel_for(int n, int grain, parallel_fn fn, void *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
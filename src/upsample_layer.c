@@ -65,8 +65,28 @@ void resize_upsample_layer(layer *l, int w, int h)
     
 }
 
+/* interleaved layout: every output pixel copies its source pixel's channels */
+static void upsample_nhwc(float *in, int w, int h, int c, int batch, int stride, float scale, float *out)
+{
+    int b, i, j, k;
+    int ow = w*stride, oh = h*stride;
+    for(b = 0; b < batch; ++b){
+        for(j = 0; j < oh; ++j){
+            for(i = 0; i < ow; ++i){
+                float *src = in + (((size_t)b*h + j/stride)*w + i/stride)*c;
+                float *dst = out + (((size_t)b*oh + j)*ow + i)*c;
+                for(k = 0; k < c; ++k) dst[k] = scale*src[k];
+            }
+        }
+    }
+}
+
 void forward_upsample_layer(const layer l, network net)
 {
+    if(net.nhwc){
+        upsample_nhwc(net.input, l.w, l.h, l.c, l.batch, l.stride, l.scale, l.output);
+        return;
+    }
     fill_cpu(l.outputs*l.batch, 0, l.output, 1);
     if(l.reverse){
         upsample_cpu(l.output, l.out_w, l.out_h, l.c, l.batch, l.stride, 0, l.scale, net.input);
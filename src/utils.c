@@ -244,6 +244,31 @@ void top_k(float *a, int n, int k, int *index)
     }
 }
 
+/* the k-th largest of a[0..n), counting from 0; reorders a */
+float nth_largest(float *a, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while(lo < hi){
+        float pivot = a[lo + (hi - lo)/2];
+        int i = lo, j = hi;
+        while(i <= j){
+            while(a[i] > pivot) ++i;
+            while(a[j] < pivot) --j;
+            if(i <= j){
+                float swap = a[i];
+                a[i] = a[j];
+                a[j] = swap;
+                ++i;
+                --j;
+            }
+        }
+        if(k <= j) hi = j;
+        else if(k >= i) lo = i;
+        else break;
+    }
+    return a[k];
+}
+
 void error(const char *s)
 {
     perror(s);
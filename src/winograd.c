@@ -0,0 +1,197 @@
+#include "winograd.h"
+#include "gemm.h"
+#include "thread_pool.h"
+
+// Lavin & Gray, "Fast Algorithms for Convolutional Neural Networks"
+// https://arxiv.org/abs/1509.09308
+//
+// Y = A^T [(G g G^T) . (B^T d B)] A, with the elementwise products over all
+// input channels batched into 36 GEMMs of (n x c) * (c x tiles).
+
+#define WINOGRAD_TILE_BLOCK 256
+// below this many input channels the transforms cost more than they save
+#define WINOGRAD_MIN_CHANNELS 16
+
+int winograd_supported(int size, int stride, int groups, int c)
+{
+    return size == 3 && stride == 1 && groups == 1 && c >= WINOGRAD_MIN_CHANNELS;
+}
+
+size_t winograd_weights_size(int n, int c)
+{
+    return (size_t)WINOGRAD_ALPHA*WINOGRAD_ALPHA*n*c;
+}
+
+static int winograd_tile_block(int out_h, int out_w)
+{
+    int tiles = ((out_h + WINOGRAD_TILE - 1)/WINOGRAD_TILE)*((out_w + WINOGRAD_TILE - 1)/WINOGRAD_TILE);
+    return (tiles < WINOGRAD_TILE_BLOCK) ? tiles : WINOGRAD_TILE_BLOCK;
+}
+
+size_t winograd_workspace_size(int n, int c, int out_h, int out_w)
+{
+    size_t tiles = winograd_tile_block(out_h, out_w);
+    return WINOGRAD_ALPHA*WINOGRAD_ALPHA*(size_t)(c + n)*tiles*sizeof(float);
+}
+
+/* G (6x3) applied to a 3-vector */
+static void winograd_g(const float *g, int gs, float *u, int us)
+{
+    u[0*us] = g[0]/4;
+    u[1*us] = -(g[0] + g[gs] + g[2*gs])/6;
+    u[2*us] = -(g[0] - g[gs] + g[2*gs])/6;
+    u[3*us] = g[0]/24 + g[gs]/12 + g[2*gs]/6;
+    u[4*us] = g[0]/24 - g[gs]/12 + g[2*gs]/6;
+    u[5*us] = g[2*gs];
+}
+
+/* B^T (6x6) applied to a 6-vector */
+static inline void winograd_bt(const float *d, int ds, float *v, int vs)
+{
+    float d0 = d[0], d1 = d[ds], d2 = d[2*ds], d3 = d[3*ds], d4 = d[4*ds], d5 = d[5*ds];
+    v[0*vs] = 4*d0 - 5*d2 + d4;
+    v[1*vs] = -4*d1 - 4*d2 + d3 + d4;
+    v[2*vs] = 4*d1 - 4*d2 - d3 + d4;
+    v[3*vs] = -2*d1 - d2 + 2*d3 + d4;
+    v[4*vs] = 2*d1 - d2 - 2*d3 + d4;
+    v[5*vs] = 4*d1 - 5*d3 + d5;
+}
+
+/* A^T (4x6) applied to a 6-vector */
+static inline void winograd_at(const float *m, int ms, float *y, int ys)
+{
+    float m0 = m[0], m1 = m[ms], m2 = m[2*ms], m3 = m[3*ms], m4 = m[4*ms], m5 = m[5*ms];
+    y[0*ys] = m0 + m1 + m2 + m3 + m4;
+    y[1*ys] = m1 - m2 + 2*m3 - 2*m4;
+    y[2*ys] = m1 + m2 + 4*m3 + 4*m4;
+    y[3*ys] = m1 - m2 + 8*m3 - 8*m4 + m5;
+}
+
+/* transformed layout: [36][n][c] */
+void winograd_transform_weights(float *weights, int n, int c, float *transformed)
+{
+    int f, k, i;
+    float tmp[6*3];
+    float u[6*6];
+    size_t plane = (size_t)n*c;
+    for(f = 0; f < n; ++f){
+        for(k = 0; k < c; ++k){
+            float *g = weights + (f*c + k)*9;
+            for(i = 0; i < 3; ++i) winograd_g(g + i, 3, tmp + i, 3);
+            for(i = 0; i < 6; ++i) winograd_g(tmp + i*3, 1, u + i*6, 1);
+            for(i = 0; i < 36; ++i) transformed[i*plane + f*c + k] = u[i];
+        }
+    }
+}
+
+typedef struct{
+    float *im;
+    int h, w, pad;
+    int tiles_w;
+    int tile0, ntiles;
+    int c, n;
+    int out_h, out_w;
+    float *v;
+    float *m;
+    const gemm_epilogue *epilogue;
+    float *out;
+} winograd_args;
+
+static void winograd_input(void *ptr, int begin, int end)
+{
+    winograd_args *a = ptr;
+    size_t plane = (size_t)a->c*a->ntiles;
+    float d[36], tmp[36], v[36];
+    int k, t, i, j;
+    for(k = begin; k < end; ++k){
+        float *im = a->im + (size_t)k*a->h*a->w;
+        for(t = 0; t < a->ntiles; ++t){
+            int tile = a->tile0 + t;
+            int y0 = (tile / a->tiles_w)*WINOGRAD_TILE - a->pad;
+            int x0 = (tile % a->tiles_w)*WINOGRAD_TILE - a->pad;
+            if(y0 >= 0 && x0 >= 0 && y0 + 6 <= a->h && x0 + 6 <= a->w){
+                for(i = 0; i < 6; ++i){
+                    for(j = 0; j < 6; ++j) d[i*6 + j] = im[(y0 + i)*a->w + x0 + j];
+                }
+            } else {
+                for(i = 0; i < 6; ++i){
+                    for(j = 0; j < 6; ++j){
+                        int y = y0 + i;
+                        int x = x0 + j;
+                        d[i*6 + j] = (y >= 0 && y < a->h && x >= 0 && x < a->w) ? im[y*a->w + x] : 0;
+                    }
+                }
+            }
+            for(i = 0; i < 6; ++i) winograd_bt(d + i, 6, tmp + i, 6);
+            for(i = 0; i < 6; ++i) winograd_bt(tmp + i*6, 1, v + i*6, 1);
+            for(i = 0; i < 36; ++i) a->v[i*plane + k*a->ntiles + t] = v[i];
+        }
+    }
+}
+
+static void winograd_output(void *ptr, int begin, int end)
+{
+    winograd_args *a = ptr;
+    size_t plane = (size_t)a->n*a->ntiles;
+    float m[36], tmp[24], y[16];
+    int f, t, i, j;
+    for(f = begin; f < end; ++f){
+        float *out = a->out + (size_t)f*a->out_h*a->out_w;
+        for(t = 0; t < a->ntiles; ++t){
+            int tile = a->tile0 + t;
+            int y0 = (tile / a->tiles_w)*WINOGRAD_TILE;
+            int x0 = (tile % a->tiles_w)*WINOGRAD_TILE;
+            for(i = 0; i < 36; ++i) m[i] = a->m[i*plane + f*a->ntiles + t];
+            for(i = 0; i < 6; ++i) winograd_at(m + i, 6, tmp + i, 6);
+            for(i = 0; i < 4; ++i) winograd_at(tmp + i*6, 1, y + i*4, 1);
+            for(i = 0; i < 4 && y0 + i < a->out_h; ++i){
+                for(j = 0; j < 4 && x0 + j < a->out_w; ++j){
+                    out[(y0 + i)*a->out_w + x0 + j] = y[i*4 + j];
+                }
+                if(a->epilogue){
+                    int col = (y0 + i)*a->out_w + x0;
+                    gemm_epilogue_run(a->epilogue, f, col, out + col, j);
+                }
+            }
+        }
+    }
+}
+
+void winograd_convolve(float *im, int c, int h, int w, int pad,
+        float *transformed, int n, int out_h, int out_w,
+        float *workspace, const gemm_epilogue *epilogue, float *out)
+{
+    int i;
+    int tiles_w = (out_w + WINOGRAD_TILE - 1)/WINOGRAD_TILE;
+    int tiles_h = (out_h + WINOGRAD_TILE - 1)/WINOGRAD_TILE;
+    int tiles = tiles_w*tiles_h;
+    int block = winograd_tile_block(out_h, out_w);
+
+    winograd_args a = {0};
+    a.im = im;
+    a.h = h;
+    a.w = w;
+    a.pad = pad;
+    a.tiles_w = tiles_w;
+    a.c = c;
+    a.n = n;
+    a.out_h = out_h;
+    a.out_w = out_w;
+    a.out = out;
+    a.epilogue = epilogue;
+    a.v = workspace;
+    a.m = workspace + (size_t)WINOGRAD_ALPHA*WINOGRAD_ALPHA*c*block;
+
+    for(a.tile0 = 0; a.tile0 < tiles; a.tile0 += block){
+        a.ntiles = (tiles - a.tile0 < block) ? tiles - a.tile0 : block;
+        parallel_for(c, 1, winograd_input, &a);
+        for(i = 0; i < WINOGRAD_ALPHA*WINOGRAD_ALPHA; ++i){
+            gemm(0,0,n,a.ntiles,c,1,
+                    transformed + (size_t)i*n*c, c,
+                    a.v + (size_t)i*c*a.ntiles, a.ntiles,
+                    0,
+                    a.m + (size_t)i*n*a.ntiles, a.ntiles);
+        }
+        parallel_for(n, 1, winograd_output, &a);
+    }
+}
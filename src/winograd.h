@@ -0,0 +1,18 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+#include "darknet.h"
+#include "gemm.h"
+
+/* Winograd F(4x4, 3x3): 6x6 input tiles, 4x4 output tiles */
+#define WINOGRAD_TILE 4
+#define WINOGRAD_ALPHA 6
+
+int winograd_supported(int size, int stride, int groups, int c);
+size_t winograd_weights_size(int n, int c);
+size_t winograd_workspace_size(int n, int c, int out_h, int out_w);
+void winograd_transform_weights(float *weights, int n, int c, float *transformed);
+void winograd_convolve(float *im, int c, int h, int w, int pad,
+        float *transformed, int n, int out_h, int out_w,
+        float *workspace, const gemm_epilogue *epilogue, float *out);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <float.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -130,12 +131,27 @@ static int entry_index(layer l, int batch, int location, int entry)
     return batch*l.outputs + n*l.w*l.h*(4+l.classes+1) + entry*l.w*l.h + loc;
 }
 
+/* inference outputs with only the objectness activated, see set_network_lazy_decode */
+static int yolo_lazy(layer l)
+{
+    return l.lazy_decode;
+}
+
 void forward_yolo_layer(const layer l, network net)
 {
     int i,j,b,t,n;
     memcpy(l.output, net.input, l.outputs*l.batch*sizeof(float));
 
 #ifndef GPU
+    // boxes and classes are activated by get_yolo_detections, for the cells it keeps
+    if(yolo_lazy(l) && !net.train){
+        for (b = 0; b < l.batch; ++b){
+            for(n = 0; n < l.n; ++n){
+                activate_array(l.output + entry_index(l, b, n*l.w*l.h, 4), l.w*l.h, LOGISTIC);
+            }
+        }
+        return;
+    }
     for (b = 0; b < l.batch; ++b){
         for(n = 0; n < l.n; ++n){
             int index = entry_index(l, b, n*l.w*l.h, 0);
@@ -146,8 +162,8 @@ void forward_yolo_layer(const layer l, network net)
     }
 #endif
 
-    memset(l.delta, 0, l.outputs * l.batch * sizeof(float));
     if(!net.train) return;
+    memset(l.delta, 0, l.outputs * l.batch * sizeof(float));
     float avg_iou = 0;
     float recall = 0;
     float recall75 = 0;
@@ -303,6 +319,32 @@ int yolo_num_detections(layer l, float thresh)
     return count;
 }
 
+/* writes the objectness of the cells above thresh, returns their count */
+int yolo_candidates(layer l, float thresh, float *objectness)
+{
+    int i, n;
+    int count = 0;
+    for(n = 0; n < l.n; ++n){
+        float *obj = l.output + entry_index(l, 0, n*l.w*l.h, 4);
+        for(i = 0; i < l.w*l.h; ++i){
+            if(obj[i] > thresh) objectness[count++] = obj[i];
+        }
+    }
+    return count;
+}
+
+/* the box offsets and classes a lazy forward pass left raw */
+static void activate_yolo_entries(layer l)
+{
+    int b, n;
+    for(b = 0; b < l.batch; ++b){
+        for(n = 0; n < l.n; ++n){
+            activate_array(l.output + entry_index(l, b, n*l.w*l.h, 0), 2*l.w*l.h, LOGISTIC);
+            activate_array(l.output + entry_index(l, b, n*l.w*l.h, 4 + 1), l.classes*l.w*l.h, LOGISTIC);
+        }
+    }
+}
+
 void avg_flipped_yolo(layer l)
 {
     int i,j,n,z;
@@ -329,11 +371,53 @@ void avg_flipped_yolo(layer l)
     }
 }
 
-int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets)
+/*
+ * Boxes and class probabilities of a cell whose raw outputs were left
+ * unactivated. A class can only pass when its raw value exceeds the logit
+ * of thresh/objectness, so the others skip the logistic.
+ */
+static inline float yolo_logistic(float x)
+{
+    return 1.f/(1.f + expf(-x));
+}
+
+static void get_yolo_detection_lazy(layer l, float *predictions, int n, int i, int netw, int neth, float thresh, detection *det)
+{
+    int j;
+    int stride = l.w*l.h;
+    int box_index = entry_index(l, 0, n*l.w*l.h + i, 0);
+    float objectness = det->objectness;
+    float x[4];
+    float r = thresh/objectness;
+    // a little below the exact logit, the comparison on prob decides
+    float cut = (r > 0) ? logf(r/(1 - r)) - 1e-3 : -FLT_MAX;
+    x[0] = yolo_logistic(predictions[box_index + 0*stride]);
+    x[1] = yolo_logistic(predictions[box_index + 1*stride]);
+    x[2] = predictions[box_index + 2*stride];
+    x[3] = predictions[box_index + 3*stride];
+    det->bbox = get_yolo_box(x, l.biases, l.mask[n], 0, i % l.w, i / l.w, l.w, l.h, netw, neth, 1);
+    for(j = 0; j < l.classes; ++j){
+        float v = predictions[entry_index(l, 0, n*l.w*l.h + i, 4 + 1 + j)];
+        float prob = (v > cut) ? objectness*yolo_logistic(v) : 0;
+        det->prob[j] = (prob > thresh) ? prob : 0;
+    }
+}
+
+/*
+ * As get_yolo_detections, but only for the cells whose objectness is above
+ * cut as well, plus the first *ties cells equal to it (counted down).
+ */
+int get_yolo_detections_cut(layer l, int w, int h, int netw, int neth, float thresh, float cut, int *ties, int *map, int relative, detection *dets)
 {
     int i,j,n;
     float *predictions = l.output;
-    if (l.batch == 2) avg_flipped_yolo(l);
+    int lazy = yolo_lazy(l);
+    if (l.batch == 2){
+        // the pair is averaged as probabilities
+        if(lazy) activate_yolo_entries(l);
+        avg_flipped_yolo(l);
+        lazy = 0;
+    }
     int count = 0;
     for (i = 0; i < l.w*l.h; ++i){
         int row = i / l.w;
@@ -341,11 +425,20 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
         for(n = 0; n < l.n; ++n){
             int obj_index  = entry_index(l, 0, n*l.w*l.h + i, 4);
             float objectness = predictions[obj_index];
-            if(objectness <= thresh) continue;
-            int box_index  = entry_index(l, 0, n*l.w*l.h + i, 0);
-            dets[count].bbox = get_yolo_box(predictions, l.biases, l.mask[n], box_index, col, row, l.w, l.h, netw, neth, l.w*l.h);
+            if(objectness <= thresh || objectness < cut) continue;
+            if(objectness == cut){
+                if(*ties <= 0) continue;
+                --*ties;
+            }
             dets[count].objectness = objectness;
             dets[count].classes = l.classes;
+            if(lazy){
+                get_yolo_detection_lazy(l, predictions, n, i, netw, neth, thresh, dets + count);
+                ++count;
+                continue;
+            }
+            int box_index  = entry_index(l, 0, n*l.w*l.h + i, 0);
+            dets[count].bbox = get_yolo_box(predictions, l.biases, l.mask[n], box_index, col, row, l.w, l.h, netw, neth, l.w*l.h);
             for(j = 0; j < l.classes; ++j){
                 int class_index = entry_index(l, 0, n*l.w*l.h + i, 4 + 1 + j);
                 float prob = objectness*predictions[class_index];
@@ -358,6 +451,11 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
     return count;
 }
 
+int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets)
+{
+    return get_yolo_detections_cut(l, w, h, netw, neth, thresh, -FLT_MAX, 0, map, relative, dets);
+}
+
 #ifdef GPU
 
 void forward_yolo_layer_gpu(const layer l, network net)